@@ -3,16 +3,114 @@
 #include <cstdio>
 #include <cstdint>
 #include <cctype>
+#include <cstddef>
+#include <ctime>
 
 // Config options
 #ifndef TEHSSL_MIN_HEAP_SIZE
-#define TEHSSL_MIN_HEAP_SIZE 64
+#define TEHSSL_MIN_HEAP_SIZE 64 // objects' worth of bytes
+#endif
+
+#ifndef TEHSSL_GC_GROWTH
+#define TEHSSL_GC_GROWTH 2.0
+#endif
+
+#ifndef TEHSSL_GC_MAX_OVERHEAD
+#define TEHSSL_GC_MAX_OVERHEAD 0.25 // fraction of the time spent collecting
+#endif
+
+#ifndef TEHSSL_PAGE_SIZE
+#ifdef __AVR__
+#define TEHSSL_PAGE_SIZE 8 // objects per heap page
+#else
+#define TEHSSL_PAGE_SIZE 64 // objects per heap page
+#endif
+#endif
+
+#ifndef TEHSSL_GC_THREADS
+#define TEHSSL_GC_THREADS 1
+#endif
+
+#ifndef TEHSSL_PARALLEL_GC_MIN_PAGES
+#define TEHSSL_PARALLEL_GC_MIN_PAGES 128 // smaller heaps are always collected on one thread
+#endif
+
+#ifndef TEHSSL_MARK_BATCH_SIZE
+#define TEHSSL_MARK_BATCH_SIZE 64 // objects a parallel marker hands to the others at a time
 #endif
 
 #ifndef TEHSSL_CHUNK_SIZE
 #define TEHSSL_CHUNK_SIZE 128
 #endif
 
+#ifndef TEHSSL_MAX_RETURN_DEPTH
+#define TEHSSL_MAX_RETURN_DEPTH 10000
+#endif
+
+#ifndef TEHSSL_INLINE_SIZE
+#define TEHSSL_INLINE_SIZE 8
+#endif
+
+#ifndef TEHSSL_STREAM_BUFFER_SIZE
+#define TEHSSL_STREAM_BUFFER_SIZE (64 * 1024)
+#endif
+
+#ifndef TEHSSL_JIT_ARENA_SIZE
+#define TEHSSL_JIT_ARENA_SIZE (256 * 1024)
+#endif
+
+#ifndef TEHSSL_JIT_CACHE_SIZE
+#define TEHSSL_JIT_CACHE_SIZE 1024 // must be a power of 2
+#endif
+
+// The JIT is built in on x86-64 Linux unless TEHSSL_NO_JIT is defined; it is switched on per VM with vm->enable_jit
+#if defined(__x86_64__) && defined(__linux__) && !defined(TEHSSL_NO_JIT)
+#define TEHSSL_JIT
+#include <sys/mman.h>
+#endif
+
+// The collector can mark and sweep on several threads on POSIX systems unless TEHSSL_NO_THREADS is defined;
+// how many is set per VM with vm->gc_threads
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(TEHSSL_NO_THREADS)
+#define TEHSSL_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Regular files are mmap()ed on POSIX systems unless TEHSSL_NO_MMAP is defined
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(TEHSSL_NO_MMAP)
+#define TEHSSL_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Clocks the GC is paced by (see tehssl_pace()); both have to count in the same unit, nanoseconds by default.
+// A collection is timed on a monotonic wall clock, so the marking and sweeping threads don't add their CPU
+// time to it. The mutator is timed on the CPU clock of the thread running the VM, so other VMs and threads
+// in the process don't count as its time. Without POSIX clocks both are clock().
+#if defined(CLOCK_MONOTONIC) && defined(CLOCK_THREAD_CPUTIME_ID)
+inline uint64_t tehssl_clock(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#ifndef TEHSSL_PAUSE_CLOCK
+#define TEHSSL_PAUSE_CLOCK() tehssl_clock(CLOCK_MONOTONIC)
+#endif
+#ifndef TEHSSL_MUTATOR_CLOCK
+#define TEHSSL_MUTATOR_CLOCK() tehssl_clock(CLOCK_THREAD_CPUTIME_ID)
+#endif
+#else
+#ifndef TEHSSL_PAUSE_CLOCK
+#define TEHSSL_PAUSE_CLOCK() ((uint64_t)clock())
+#endif
+#ifndef TEHSSL_MUTATOR_CLOCK
+#define TEHSSL_MUTATOR_CLOCK() ((uint64_t)clock())
+#endif
+#endif
+
 #ifdef TEHSSL_DEBUG
 #define DEBUG printf
 #else
@@ -26,7 +124,8 @@ enum tehssl_status {
     RETURN,
     BREAK,
     CONTINUE,
-    OUT_OF_MEMORY
+    OUT_OF_MEMORY,
+    CALL
 };
 
 enum tehssl_flag {
@@ -34,6 +133,12 @@ enum tehssl_flag {
     GC_MARK_PERM,
     PR_MARK,
     VARIABLE,
+    PURE,
+    VIEW,
+    MAPPED,
+    OPTIMIZE,
+    FREE,
+    SHADOWED
 };
 
 enum tehssl_symbol_type {
@@ -53,6 +158,11 @@ enum tehssl_function_type {
     TYPE_FUNCTION
 };
 
+enum tehssl_compile_options {
+    COMPILE_OPTIMIZE = 1,
+    COMPILE_LAZY = 2
+};
+
 enum tehssl_cell_infobits {
     CAR_PTR = 2,
     CDR_PTR = 1,
@@ -71,15 +181,19 @@ enum tehssl_typeid {
     INT,         //   int64_t
     SINGLETON,   //   int
     SYMBOL,      //   char*        flags
-    STRING,      //   char*
-    STREAM,      //   char*        FILE*
+    STRING,      //   char*        (owner) if VIEW, with the length in view_length
+    STREAM,      //   char*        stream*
     // Special internal types
     SCOPE,       //   (bindings)   (parent)
     NAME,        //   char*        (value)
-    FUNCTION     //   (value)      flags
+    FUNCTION,    //   (value)      flags
+    BUFFER,      //   char*        size_t
+    LAZY         //   (unit)       size_t       a block that hasn't been compiled yet
     // USERTYPE
 };
 // N.B. the char* pointers are "owned" by the object and MUST be strcpy()'d if the object is duplicated.
+// The exception is a STRING with the VIEW flag, whose chars point into its owner BUFFER and aren't
+// '\0'-terminated; see tehssl_string_length().
 
 enum tehssl_singleton {
     TRUE,
@@ -97,14 +211,19 @@ typedef enum tehssl_symbol_type tehssl_symbol_type_t;
 typedef enum tehssl_function_type tehssl_function_type_t;
 typedef struct tehssl_object *tehssl_object_t;
 typedef struct tehssl_vm *tehssl_vm_t;
+typedef struct tehssl_stream *tehssl_stream_t;
 typedef void (*tehssl_fun_t)(tehssl_vm_t, tehssl_object_t);
+typedef uint32_t (*tehssl_jit_fun_t)(tehssl_vm_t, tehssl_object_t);
 typedef uint16_t tehssl_flags_t;
 
 // Main OBJECT type
 struct tehssl_object {
     tehssl_typeid_t type;
     tehssl_flags_t flags;
-    tehssl_object_t next_object;
+    union {
+        tehssl_object_t next_free; // only while the slot is FREE
+        size_t view_length;        // STRING with the VIEW flag
+    };
     union {
         double float_number;
         int64_t int_number;
@@ -115,14 +234,18 @@ struct tehssl_object {
                 tehssl_object_t value;
                 tehssl_object_t scope;
                 char* chars;
+                tehssl_fun_t c_function;
             };
             union {
                 tehssl_object_t cdr;
                 tehssl_object_t next;
                 tehssl_object_t parent;
                 tehssl_object_t code;
-                FILE* file;
-                tehssl_fun_t c_function;
+                tehssl_object_t binding;
+                tehssl_object_t owner;
+                tehssl_stream_t stream;
+                size_t length;
+                size_t offset;
                 tehssl_symbol_type_t symboltype;
                 tehssl_function_type_t functiontype;
             };
@@ -130,6 +253,62 @@ struct tehssl_object {
     };
 };
 
+// Input behind a STREAM object.
+// Either the whole input is already in memory (a string, or an mmap()ed file) and file is NULL,
+// or it is read from file in TEHSSL_STREAM_BUFFER_SIZE chunks. Lines are handed out as STRING
+// views into the BUFFER, so a buffer with views in it can't be refilled. The next chunk goes into
+// the spare, and the old buffer becomes the spare. The stream doesn't keep its spare alive until
+// the GC has found no views into it (see tehssl_reclaim_buffers()); up to then the views do.
+struct tehssl_stream {
+    FILE* file;
+    tehssl_object_t buffer;
+    size_t start;    // next unread byte
+    size_t end;      // end of the data in buffer
+    bool pinned;     // buffer has views in it
+    tehssl_object_t spare;
+    bool spare_free; // the GC found no views into spare, so it can be refilled
+    bool retiring;   // on vm->retiring
+};
+
+// Heap page
+// Objects are allocated out of fixed-size pages and free slots are kept on vm->free_list. Pages are
+// what the parallel sweep splits up between threads, and a page is given back once it is empty.
+struct tehssl_page {
+    size_t live; // objects in use as of the last sweep
+    struct tehssl_object objects[TEHSSL_PAGE_SIZE];
+};
+
+// Return stack frame
+// One per user function call that is still running; calls in tail position reuse the caller's frame.
+struct tehssl_frame {
+    tehssl_object_t code;  // BLOCK node of the next line to run
+    tehssl_object_t line;  // rest of the line being macro-expanded
+    tehssl_object_t items; // rest of the current line, reversed
+    tehssl_object_t scope;
+};
+typedef struct tehssl_frame tehssl_frame_t;
+
+// Hot-swapped definition
+// Compiled off the VM's thread and pushed onto vm->swaps with a CAS. Each node points at the one
+// published before it. Once a newer one has been swapped in, the VM frees it (see tehssl_apply_swaps()).
+struct tehssl_swap {
+    struct tehssl_swap* prev;
+    uint64_t version;
+    char* name;
+    tehssl_object_t block;
+    struct tehssl_page** pages; // the pages compiled into, until they are spliced into the heap
+    size_t num_pages;
+    size_t num_objects;
+    size_t heap_bytes;
+};
+
+#ifdef TEHSSL_JIT
+struct tehssl_jit_entry {
+    tehssl_object_t line;
+    tehssl_jit_fun_t code; // NULL if the line can't be compiled
+};
+#endif
+
 // TEHSSL VM type
 struct tehssl_vm {
     tehssl_object_t stack;
@@ -137,15 +316,60 @@ struct tehssl_vm {
     tehssl_object_t global_scope;
     tehssl_object_t gc_stack;
     tehssl_status_t status;
-    tehssl_object_t first_object;
     tehssl_object_t type_functions;
+    struct tehssl_page** pages;
+    size_t num_pages;
+    size_t pages_capacity;
+    tehssl_object_t free_list;
     size_t num_objects;
-    size_t next_gc;
+    size_t heap_bytes; // everything the GC owns: pages and the strings, buffers and streams in them
+    size_t heap_peak;
+    size_t heap_limit; // hard quota in bytes, 0 for none
+    size_t next_gc;    // collect when heap_bytes would pass this
+    double gc_growth;  // next_gc is live bytes times this...
+    size_t gc_target;  // ...or this, if it is set and more than what's live
+    double gc_survival;  // running average of the fraction of the heap that survives a collection
+    size_t allocated;    // bytes allocated since the last collection
+    uint64_t gc_clock;   // TEHSSL_MUTATOR_CLOCK() when the last collection finished
+    size_t gc_count;
+    size_t gc_threads; // threads to mark and sweep with, counting the VM's own
     bool enable_gc;
+    tehssl_frame_t* return_stack;
+    size_t return_depth;
+    size_t return_capacity;
+    bool enable_jit;
+    bool bound_locally; // set once any scope but the global one has bound a name
+    size_t calls;              // builtins the evaluator has called
+    tehssl_object_t temp_box;  // number the last typed builtin left in temp_cell, referred to from nowhere else
+    tehssl_object_t temp_cell; // while calls is still temp_calls (see tehssl_typed_result)
+    size_t temp_calls;
+    tehssl_object_t booleans[2]; // the TRUE and FALSE typed builtins return, made on first use
+    tehssl_object_t* retiring;   // STREAMs whose spare buffer may still have views into it
+    size_t num_retiring;
+    size_t retiring_capacity;
+    struct tehssl_swap* swaps;   // newest published definition; written by any thread
+    struct tehssl_swap* applied; // newest definition swapped in; VM thread only
+    size_t publishing;           // tehssl_hotswap() calls that may be holding an old vm->swaps
+    uint64_t epoch;              // version of applied, readable from any thread
+    #ifdef TEHSSL_THREADS
+    struct tehssl_gc_helpers* gc_helpers; // started by the first parallel collection
+    #endif
+    #ifdef TEHSSL_JIT
+    uint8_t* jit_arena;
+    size_t jit_used;
+    size_t jit_depth;
+    struct tehssl_jit_entry* jit_cache;
+    #endif
 };
 
 // Forward references
 size_t tehssl_gc(tehssl_vm_t);
+void tehssl_optimize_unit(tehssl_vm_t, tehssl_object_t, tehssl_object_t);
+void tehssl_apply_swaps(tehssl_vm_t);
+#ifdef TEHSSL_JIT
+void tehssl_jit_sweep(tehssl_vm_t);
+void tehssl_jit_free(tehssl_vm_t);
+#endif
 
 #ifdef TEHSSL_DEBUG
 void debug_print_type(tehssl_typeid_t t) {
@@ -163,12 +387,19 @@ void debug_print_type(tehssl_typeid_t t) {
         case SCOPE: printf("SCOPE"); break;
         case NAME: printf("NAME"); break;
         case FUNCTION: printf("FUNCTION"); break;
+        case BUFFER: printf("BUFFER"); break;
+        case LAZY: printf("LAZY"); break;
     }
 }
 #else
 #define debug_print_type(x)
 #endif
 
+// Flags test
+#define tehssl_set_flag(x, f) ((x)->flags |= (1 << (f)))
+#define tehssl_clear_flag(x, f) ((x)->flags &= ~(1 << (f)))
+#define tehssl_test_flag(x, f) ((x)->flags & (1 << (f)))
+
 inline bool tehssl_is_literal(tehssl_object_t object) {
     if (object == NULL) return true;
     switch (object->type) {
@@ -186,6 +417,10 @@ inline bool tehssl_is_literal(tehssl_object_t object) {
     }
 }
 
+inline bool tehssl_is_block(tehssl_object_t object) {
+    return object != NULL && (object->type == BLOCK || object->type == LAZY);
+}
+
 inline uint8_t tehssl_get_cell_info(tehssl_object_t obj) {
     if (obj == NULL) return 0;
     switch (obj->type) {
@@ -196,9 +431,11 @@ inline uint8_t tehssl_get_cell_info(tehssl_object_t obj) {
         case FLOAT:
         case INT: 
         case SINGLETON: return NO_PTR;
+        case STRING: return tehssl_test_flag(obj, VIEW) ? CAR_STRING | CDR_PTR : CAR_STRING;
         case SYMBOL:
-        case STRING:
         case STREAM: return CAR_STRING;
+        case BUFFER: return NO_PTR;
+        case LAZY: return CAR_PTR;
         case SCOPE: return CAR_PTR | CDR_PTR;
         case NAME: return CAR_STRING | CDR_PTR;
         case FUNCTION: return (obj->functiontype == USERFUNCTION || obj->functiontype == MACRO) ? CAR_PTR : NO_PTR;
@@ -206,12 +443,12 @@ inline uint8_t tehssl_get_cell_info(tehssl_object_t obj) {
     }
 }
 
-// Flags test
-#define tehssl_set_flag(x, f) ((x)->flags |= (1 << (f)))
-#define tehssl_clear_flag(x, f) ((x)->flags &= ~(1 << (f)))
-#define tehssl_test_flag(x, f) ((x)->flags & (1 << (f)))
-
 // Alloc
+inline size_t tehssl_min_room() {
+    size_t room = TEHSSL_MIN_HEAP_SIZE * sizeof(struct tehssl_object);
+    return room < sizeof(struct tehssl_page) ? sizeof(struct tehssl_page) : room;
+}
+
 tehssl_vm_t tehssl_new_vm() {
     tehssl_vm_t vm = (tehssl_vm_t)malloc(sizeof(struct tehssl_vm));
     vm->stack = NULL;
@@ -219,38 +456,224 @@ tehssl_vm_t tehssl_new_vm() {
     vm->global_scope = NULL;
     vm->gc_stack = NULL;
     vm->type_functions = NULL;
-    vm->first_object = NULL;
+    vm->pages = NULL;
+    vm->num_pages = 0;
+    vm->pages_capacity = 0;
+    vm->free_list = NULL;
     vm->status = OK;
     vm->num_objects = 0;
-    vm->next_gc = TEHSSL_MIN_HEAP_SIZE;
+    vm->heap_bytes = 0;
+    vm->heap_peak = 0;
+    vm->heap_limit = 0;
+    vm->next_gc = tehssl_min_room();
+    vm->gc_growth = TEHSSL_GC_GROWTH;
+    vm->gc_target = 0;
+    vm->gc_survival = 0;
+    vm->allocated = 0;
+    vm->gc_clock = TEHSSL_MUTATOR_CLOCK();
+    vm->gc_count = 0;
+    vm->gc_threads = TEHSSL_GC_THREADS;
     vm->enable_gc = true;
+    vm->return_stack = NULL;
+    vm->return_depth = 0;
+    vm->return_capacity = 0;
+    vm->enable_jit = false;
+    vm->bound_locally = false;
+    vm->calls = 0;
+    vm->temp_box = NULL;
+    vm->temp_cell = NULL;
+    vm->temp_calls = 0;
+    vm->booleans[TRUE] = vm->booleans[FALSE] = NULL;
+    vm->retiring = NULL;
+    vm->num_retiring = 0;
+    vm->retiring_capacity = 0;
+    vm->swaps = NULL;
+    vm->applied = NULL;
+    vm->publishing = 0;
+    #ifdef TEHSSL_THREADS
+    vm->gc_helpers = NULL;
+    #endif
+    vm->epoch = 0;
+    #ifdef TEHSSL_JIT
+    vm->jit_arena = NULL;
+    vm->jit_used = 0;
+    vm->jit_depth = 0;
+    vm->jit_cache = NULL;
+    #endif
     return vm;
 }
 
-tehssl_object_t tehssl_alloc(tehssl_vm_t vm, tehssl_typeid_t type) {
-    if (vm->num_objects >= vm->next_gc && vm->enable_gc) tehssl_gc(vm);
-    tehssl_object_t object = (tehssl_object_t)malloc(sizeof(struct tehssl_object));
-    if (!object) {
+// Heap pages
+bool tehssl_reserve_pages(tehssl_vm_t vm, size_t n) {
+    if (vm->num_pages + n <= vm->pages_capacity) return true;
+    size_t capacity = vm->pages_capacity == 0 ? 16 : vm->pages_capacity * 2;
+    while (capacity < vm->num_pages + n) capacity *= 2;
+    struct tehssl_page** pages = (struct tehssl_page**)realloc(vm->pages, capacity * sizeof(struct tehssl_page*));
+    if (pages == NULL) return false;
+    vm->pages = pages;
+    vm->pages_capacity = capacity;
+    return true;
+}
+
+bool tehssl_add_page(tehssl_vm_t vm) {
+    if (!tehssl_reserve_pages(vm, 1)) return false;
+    struct tehssl_page* page = (struct tehssl_page*)calloc(1, sizeof(struct tehssl_page));
+    if (page == NULL) return false;
+    for (size_t i = TEHSSL_PAGE_SIZE; i > 0; i--) {
+        tehssl_object_t slot = &page->objects[i - 1];
+        tehssl_set_flag(slot, FREE);
+        slot->next_free = vm->free_list;
+        vm->free_list = slot;
+    }
+    vm->pages[vm->num_pages++] = page;
+    vm->heap_bytes += sizeof(struct tehssl_page);
+    DEBUG("Added heap page %zu\n", vm->num_pages);
+    return true;
+}
+
+// Visits every object in use: tehssl_each_object(vm, o) { ... }
+#define tehssl_each_object(vm, o) \
+    for (size_t o##_page = 0; o##_page < (vm)->num_pages; o##_page++) \
+        for (tehssl_object_t o = (vm)->pages[o##_page]->objects; o < (vm)->pages[o##_page]->objects + TEHSSL_PAGE_SIZE; o++) \
+            if (!tehssl_test_flag(o, FREE))
+
+// Heap accounting
+// Pages are charged whole when they are added, so heap_bytes is what the heap really takes up, free
+// slots included. payload is what the object will own besides its slot (its string, buffer or stream
+// struct). It is charged here, so the collection and the quota check happen before anything is
+// allocated; the caller allocates the payload afterwards and calls tehssl_uncharge() if that fails.
+// Fails with OUT_OF_MEMORY if it would take the VM past heap_limit even after a collection.
+tehssl_object_t tehssl_alloc(tehssl_vm_t vm, tehssl_typeid_t type, size_t payload = 0) {
+    size_t bytes = vm->free_list == NULL ? payload + sizeof(struct tehssl_page) : payload;
+    bool over = vm->heap_limit != 0 && vm->heap_bytes + bytes > vm->heap_limit;
+    if ((over || vm->heap_bytes + bytes > vm->next_gc) && vm->enable_gc) {
+        tehssl_gc(vm);
+        bytes = vm->free_list == NULL ? payload + sizeof(struct tehssl_page) : payload;
+    }
+    if (vm->heap_limit != 0 && vm->heap_bytes + bytes > vm->heap_limit) {
+        DEBUG("Allocating %zu bytes would go over the %zu byte quota\n", bytes, vm->heap_limit);
+        vm->status = OUT_OF_MEMORY;
+        return NULL;
+    }
+    if (vm->free_list == NULL && !tehssl_add_page(vm)) {
         vm->status = OUT_OF_MEMORY;
         return NULL;
     }
+    tehssl_object_t object = vm->free_list;
+    vm->free_list = object->next_free;
     memset(object, 0, sizeof(struct tehssl_object));
     object->type = type;
-    object->next_object = vm->first_object;
-    vm->first_object = object;
     vm->num_objects++;
+    vm->heap_bytes += payload;
+    vm->allocated += sizeof(struct tehssl_object) + payload;
+    if (vm->heap_bytes > vm->heap_peak) vm->heap_peak = vm->heap_bytes;
     DEBUG("Allocating a ");
     debug_print_type(type);
-    DEBUG(": Now have %zu objects\n", vm->num_objects);
+    DEBUG(": Now have %zu objects, %zu bytes\n", vm->num_objects, vm->heap_bytes);
+    return object;
+}
+
+void tehssl_uncharge(tehssl_vm_t vm, size_t payload) {
+    vm->heap_bytes -= payload;
+    vm->allocated -= payload;
+}
+
+// Must match what was charged when the payload was allocated
+size_t tehssl_payload_size(tehssl_object_t object) {
+    size_t size = 0;
+    if (object->type == STREAM && object->stream != NULL) size += sizeof(struct tehssl_stream);
+    if (object->type == BUFFER && object->chars != NULL) size += object->length;
+    if ((tehssl_get_cell_info(object) & CAR_STRING) && !tehssl_test_flag(object, VIEW) && object->chars != NULL) size += strlen(object->chars) + 1;
+    return size;
+}
+
+// Allocates an object that owns a copy of string
+tehssl_object_t tehssl_alloc_string(tehssl_vm_t vm, tehssl_typeid_t type, const char* string, size_t length) {
+    tehssl_object_t object = tehssl_alloc(vm, type, length + 1);
+    if (object == NULL) return NULL;
+    object->chars = strndup(string, length);
+    if (object->chars == NULL) {
+        // Left for the GC
+        tehssl_uncharge(vm, length + 1);
+        vm->status = OUT_OF_MEMORY;
+        return NULL;
+    }
     return object;
 }
 
+inline size_t tehssl_string_length(tehssl_object_t string) {
+    return tehssl_test_flag(string, VIEW) ? string->view_length : strlen(string->chars);
+}
+
+// Gives a STRING view a '\0'-terminated copy of its own, for C code that needs one. The buffer
+// it pointed into is left for the GC. False (and OUT_OF_MEMORY) if there's no room for the copy.
+bool tehssl_detach_view(tehssl_vm_t vm, tehssl_object_t string) {
+    if (!tehssl_test_flag(string, VIEW)) return true;
+    char* chars = strndup(string->chars, string->view_length);
+    size_t payload = chars != NULL ? strlen(chars) + 1 : 0;
+    if (chars == NULL || (vm->heap_limit != 0 && vm->heap_bytes + payload > vm->heap_limit)) {
+        free(chars);
+        vm->status = OUT_OF_MEMORY;
+        return false;
+    }
+    vm->heap_bytes += payload;
+    vm->allocated += payload;
+    if (vm->heap_bytes > vm->heap_peak) vm->heap_peak = vm->heap_bytes;
+    string->chars = chars;
+    string->owner = NULL;
+    string->view_length = 0;
+    tehssl_clear_flag(string, VIEW);
+    return true;
+}
+
+// Frees what an unreached object owns and returns how many bytes that was. Doesn't touch the VM,
+// so the sweep threads can call it.
+size_t tehssl_free_payload(tehssl_object_t unreached) {
+    size_t size = tehssl_payload_size(unreached);
+    if (unreached->type == STREAM && unreached->stream != NULL) {
+        DEBUG(" +FILE");
+        if (unreached->stream->file != NULL) fclose(unreached->stream->file);
+        free(unreached->stream);
+        unreached->stream = NULL;
+    }
+    if (unreached->type == BUFFER) {
+        DEBUG(" +%zu bytes", unreached->length);
+        #ifdef TEHSSL_MMAP
+        if (tehssl_test_flag(unreached, MAPPED)) munmap(unreached->chars, unreached->length);
+        else
+        #endif
+        free(unreached->chars);
+        unreached->chars = NULL;
+    }
+    if ((tehssl_get_cell_info(unreached) & CAR_STRING) && !tehssl_test_flag(unreached, VIEW)) {
+        DEBUG(" name-> \"%s\"", unreached->chars);
+        free(unreached->chars);
+        unreached->chars = NULL;
+    }
+    #ifdef TEHSSL_DEBUG
+    if (unreached->type == FLOAT) printf(" number-> %g", unreached->float_number);
+    if (unreached->type == SINGLETON) printf(" singleton-> %i", unreached->singleton);
+    #endif
+    return size;
+}
+
+void tehssl_free_pages(struct tehssl_page** pages, size_t num_pages) {
+    for (size_t p = 0; p < num_pages; p++) {
+        for (size_t i = 0; i < TEHSSL_PAGE_SIZE; i++) {
+            if (!tehssl_test_flag(&pages[p]->objects[i], FREE)) tehssl_free_payload(&pages[p]->objects[i]);
+        }
+        free(pages[p]);
+    }
+}
+
 // Garbage collection
+struct tehssl_marker;
+
 void tehssl_markobject(tehssl_vm_t vm, tehssl_object_t object, tehssl_flag_t flag = GC_MARK_TEMP) {
     MARK:
     // already marked? abort
     if (object == NULL) {
-        
+
         DEBUG("Marking NULL\n");
         return;
     }
@@ -261,6 +684,10 @@ void tehssl_markobject(tehssl_vm_t vm, tehssl_object_t object, tehssl_flag_t fla
     }
     tehssl_set_flag(object, flag);
     uint8_t usage = tehssl_get_cell_info(object);
+    if (object->type == STREAM && object->stream != NULL) {
+        tehssl_markobject(vm, object->stream->buffer, flag);
+        if (object->stream->spare_free) tehssl_markobject(vm, object->stream->spare, flag);
+    }
     if (usage & CAR_PTR) tehssl_markobject(vm, object->car, flag);
     if (usage & CDR_PTR) {
         object = object->cdr;
@@ -268,48 +695,483 @@ void tehssl_markobject(tehssl_vm_t vm, tehssl_object_t object, tehssl_flag_t fla
     }
 }
 
-void tehssl_markall(tehssl_vm_t vm) {
-    tehssl_markobject(vm, vm->stack);
-    tehssl_markobject(vm, vm->return_value);
-    tehssl_markobject(vm, vm->global_scope);
+#ifdef TEHSSL_THREADS
+// Parallel marking
+// Each marker keeps the objects it still has to scan on a private stack, which it pushes and pops
+// without locking. Whenever there are more idle markers than batches on the shared list, a marker
+// with more than one object on its stack moves the bottom half of it (up to TEHSSL_MARK_BATCH_SIZE
+// objects) into a batch on the list. Those were pushed first, so they are the roots of the biggest
+// parts still to scan. A marker whose stack runs dry takes a whole batch from the list; only the
+// list has a lock. Marking an object is a plain load and store, so two markers can race to scan
+// the same object, which costs time but nothing else. A marker only goes idle with its stack empty,
+// and only busy markers publish, so once all of them are idle with nothing on the list the marking
+// is done.
+struct tehssl_mark_batch {
+    struct tehssl_mark_batch* next;
+    size_t size;
+    tehssl_object_t items[TEHSSL_MARK_BATCH_SIZE];
+};
+
+struct tehssl_marking {
+    pthread_mutex_t lock;
+    struct tehssl_mark_batch* batches;
+    size_t published; // batches on the list, readable without the lock
+    struct tehssl_marker* markers;
+    size_t count;
+    size_t idle;
+    size_t shared; // batches published during this collection
+};
+
+struct tehssl_marker {
+    struct tehssl_marking* marking;
+    size_t id;
+    tehssl_object_t* items; // private stack, always with room for a batch
+    size_t size;
+    size_t capacity;
+    struct tehssl_mark_batch* spare; // emptied batches, to publish into
+    size_t scanned; // objects marked during this collection
+};
+
+void tehssl_mark_from(struct tehssl_marker*, tehssl_object_t);
+
+void tehssl_publish(struct tehssl_marker* marker) {
+    struct tehssl_mark_batch* batch = marker->spare;
+    if (batch != NULL) marker->spare = batch->next;
+    else batch = (struct tehssl_mark_batch*)malloc(sizeof(struct tehssl_mark_batch));
+    if (batch == NULL) return;
+    size_t n = marker->size / 2 < TEHSSL_MARK_BATCH_SIZE ? marker->size / 2 : TEHSSL_MARK_BATCH_SIZE;
+    batch->size = n;
+    memcpy(batch->items, marker->items, n * sizeof(tehssl_object_t));
+    marker->size -= n;
+    memmove(marker->items, marker->items + n, marker->size * sizeof(tehssl_object_t));
+    struct tehssl_marking* marking = marker->marking;
+    pthread_mutex_lock(&marking->lock);
+    batch->next = marking->batches;
+    marking->batches = batch;
+    marking->shared++;
+    __atomic_add_fetch(&marking->published, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&marking->lock);
+}
+
+// Only called with the marker's own stack empty
+bool tehssl_take_batch(struct tehssl_marker* marker) {
+    struct tehssl_marking* marking = marker->marking;
+    if (__atomic_load_n(&marking->published, __ATOMIC_SEQ_CST) == 0) return false;
+    pthread_mutex_lock(&marking->lock);
+    struct tehssl_mark_batch* batch = marking->batches;
+    if (batch != NULL) {
+        marking->batches = batch->next;
+        __atomic_sub_fetch(&marking->published, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&marking->lock);
+    if (batch == NULL) return false;
+    memcpy(marker->items, batch->items, batch->size * sizeof(tehssl_object_t));
+    marker->size = batch->size;
+    batch->next = marker->spare;
+    marker->spare = batch;
+    return true;
+}
+
+inline void tehssl_mark_later(struct tehssl_marker* marker, tehssl_object_t object) {
+    if (object == NULL) return;
+    if (marker->size == marker->capacity) {
+        size_t capacity = marker->capacity * 2;
+        tehssl_object_t* items = (tehssl_object_t*)realloc(marker->items, capacity * sizeof(tehssl_object_t));
+        if (items == NULL) {
+            // Out of memory for the stack: scan it now on the C stack instead
+            tehssl_mark_from(marker, object);
+            return;
+        }
+        marker->items = items;
+        marker->capacity = capacity;
+    }
+    marker->items[marker->size++] = object;
+    struct tehssl_marking* marking = marker->marking;
+    if (marker->size > 1 && __atomic_load_n(&marking->idle, __ATOMIC_RELAXED) > __atomic_load_n(&marking->published, __ATOMIC_RELAXED)) tehssl_publish(marker);
+}
+
+void tehssl_mark_from(struct tehssl_marker* marker, tehssl_object_t object) {
+    while (object != NULL) {
+        // No read-modify-write needed: the mark is the only flag that changes while marking, so two
+        // markers racing for an object store the same flags and at worst both scan it
+        tehssl_flags_t old = __atomic_load_n(&object->flags, __ATOMIC_RELAXED);
+        if (old & (1 << GC_MARK_TEMP)) return;
+        __atomic_store_n(&object->flags, (tehssl_flags_t)(old | (1 << GC_MARK_TEMP)), __ATOMIC_RELAXED);
+        marker->scanned++;
+        uint8_t usage = object->type != STRING ? tehssl_get_cell_info(object) : (old & (1 << VIEW)) ? CAR_STRING | CDR_PTR : CAR_STRING;
+        if (object->type == STREAM && object->stream != NULL) {
+            tehssl_mark_later(marker, object->stream->buffer);
+            if (object->stream->spare_free) tehssl_mark_later(marker, object->stream->spare);
+        }
+        // car first, like tehssl_markobject(), which mostly goes through memory in the order it was allocated
+        if (usage & CDR_PTR) tehssl_mark_later(marker, object->cdr);
+        object = (usage & CAR_PTR) ? object->car : NULL;
+    }
+}
+
+// Only marker 0 starts out with work; the others are counted idle from the start, so that it
+// publishes some right away
+void* tehssl_mark_worker(void* arg) {
+    struct tehssl_marker* marker = (struct tehssl_marker*)arg;
+    struct tehssl_marking* marking = marker->marking;
+    bool idle = marker->id != 0;
+    while (true) {
+        if (idle) {
+            while (__atomic_load_n(&marking->published, __ATOMIC_SEQ_CST) == 0) {
+                if (__atomic_load_n(&marking->idle, __ATOMIC_SEQ_CST) == marking->count) return NULL;
+                sched_yield();
+            }
+            __atomic_sub_fetch(&marking->idle, 1, __ATOMIC_SEQ_CST);
+            idle = false;
+        }
+        if (marker->size > 0 || tehssl_take_batch(marker)) {
+            tehssl_mark_from(marker, marker->items[--marker->size]);
+            continue;
+        }
+        __atomic_add_fetch(&marking->idle, 1, __ATOMIC_SEQ_CST);
+        idle = true;
+    }
+}
+
+// GC helper threads
+// Started the first time a collection runs on more than one thread, and kept until the VM is destroyed
+// or vm->gc_threads changes. In between collections they sleep on a condition variable; the VM's thread
+// hands them each phase as a job and does its own part of it.
+typedef void* (*tehssl_gc_job_t)(void*);
+
+struct tehssl_gc_helper {
+    struct tehssl_gc_helpers* helpers;
+    size_t id;           // the VM's own thread is 0
+    uint64_t generation; // of the last job it saw
+    pthread_t thread;
+};
+
+struct tehssl_gc_helpers {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // a new job, or stop
+    pthread_cond_t done; // all parts of the job are done
+    struct tehssl_gc_helper* threads;
+    size_t count;        // helpers running
+    size_t wanted;       // vm->gc_threads when they were started
+    uint64_t generation; // bumped for each job
+    tehssl_gc_job_t job;
+    char* args;          // the argument for thread i is at args + i * size
+    size_t size;
+    size_t parts;        // threads doing the job, counting the VM's
+    size_t finished;
+    bool stop;
+    struct tehssl_marking marking; // kept between collections along with the markers' stacks
+};
+
+void* tehssl_gc_helper_main(void* arg) {
+    struct tehssl_gc_helper* helper = (struct tehssl_gc_helper*)arg;
+    struct tehssl_gc_helpers* helpers = helper->helpers;
+    pthread_mutex_lock(&helpers->lock);
+    while (true) {
+        while (!helpers->stop && helpers->generation == helper->generation) pthread_cond_wait(&helpers->wake, &helpers->lock);
+        if (helpers->stop) break;
+        helper->generation = helpers->generation;
+        if (helper->id >= helpers->parts) continue;
+        tehssl_gc_job_t job = helpers->job;
+        void* part = helpers->args + helper->id * helpers->size;
+        pthread_mutex_unlock(&helpers->lock);
+        job(part);
+        pthread_mutex_lock(&helpers->lock);
+        if (++helpers->finished == helpers->parts - 1) pthread_cond_signal(&helpers->done);
+    }
+    pthread_mutex_unlock(&helpers->lock);
+    return NULL;
+}
+
+// Runs job on each of the first parts elements of args (size bytes apart): the first on the calling
+// thread and the rest on helpers, of which there must be enough. Returns when they are all done.
+void tehssl_gc_run(tehssl_vm_t vm, tehssl_gc_job_t job, void* args, size_t size, size_t parts) {
+    struct tehssl_gc_helpers* helpers = vm->gc_helpers;
+    pthread_mutex_lock(&helpers->lock);
+    helpers->job = job;
+    helpers->args = (char*)args;
+    helpers->size = size;
+    helpers->parts = parts;
+    helpers->finished = 0;
+    helpers->generation++;
+    pthread_cond_broadcast(&helpers->wake);
+    pthread_mutex_unlock(&helpers->lock);
+    job(args);
+    pthread_mutex_lock(&helpers->lock);
+    while (helpers->finished < parts - 1) pthread_cond_wait(&helpers->done, &helpers->lock);
+    pthread_mutex_unlock(&helpers->lock);
+}
+
+void tehssl_gc_stop_helpers(tehssl_vm_t vm) {
+    struct tehssl_gc_helpers* helpers = vm->gc_helpers;
+    if (helpers == NULL) return;
+    pthread_mutex_lock(&helpers->lock);
+    helpers->stop = true;
+    pthread_cond_broadcast(&helpers->wake);
+    pthread_mutex_unlock(&helpers->lock);
+    for (size_t i = 0; i < helpers->count; i++) pthread_join(helpers->threads[i].thread, NULL);
+    pthread_mutex_destroy(&helpers->lock);
+    pthread_cond_destroy(&helpers->wake);
+    pthread_cond_destroy(&helpers->done);
+    pthread_mutex_destroy(&helpers->marking.lock);
+    for (size_t i = 0; i < helpers->wanted && helpers->marking.markers != NULL; i++) {
+        struct tehssl_marker* marker = &helpers->marking.markers[i];
+        free(marker->items);
+        while (marker->spare != NULL) {
+            struct tehssl_mark_batch* next = marker->spare->next;
+            free(marker->spare);
+            marker->spare = next;
+        }
+    }
+    free(helpers->marking.markers);
+    free(helpers->threads);
+    free(helpers);
+    vm->gc_helpers = NULL;
+}
+
+// Starts up to vm->gc_threads - 1 helpers. If none can be started the VM collects on its own thread
+// until gc_threads is changed.
+void tehssl_gc_start_helpers(tehssl_vm_t vm) {
+    struct tehssl_gc_helpers* helpers = (struct tehssl_gc_helpers*)calloc(1, sizeof(struct tehssl_gc_helpers));
+    if (helpers == NULL) return;
+    helpers->wanted = vm->gc_threads;
+    helpers->threads = (struct tehssl_gc_helper*)calloc(helpers->wanted - 1, sizeof(struct tehssl_gc_helper));
+    helpers->marking.markers = (struct tehssl_marker*)calloc(helpers->wanted, sizeof(struct tehssl_marker));
+    pthread_mutex_init(&helpers->lock, NULL);
+    pthread_cond_init(&helpers->wake, NULL);
+    pthread_cond_init(&helpers->done, NULL);
+    pthread_mutex_init(&helpers->marking.lock, NULL);
+    vm->gc_helpers = helpers;
+    if (helpers->threads == NULL || helpers->marking.markers == NULL) return;
+    for (size_t i = 0; i < helpers->wanted; i++) {
+        helpers->marking.markers[i].marking = &helpers->marking;
+        helpers->marking.markers[i].id = i;
+    }
+    for (size_t i = 0; i < helpers->wanted - 1; i++) {
+        struct tehssl_gc_helper* helper = &helpers->threads[helpers->count];
+        helper->helpers = helpers;
+        helper->id = helpers->count + 1;
+        if (pthread_create(&helper->thread, NULL, tehssl_gc_helper_main, helper) != 0) break;
+        helpers->count++;
+    }
+    DEBUG("Started %zu GC helper threads\n", helpers->count);
+}
+#endif
+
+// With a marker the roots are only queued on it, for tehssl_mark_worker()
+void tehssl_markroot(tehssl_vm_t vm, struct tehssl_marker* marker, tehssl_object_t root) {
+    #ifdef TEHSSL_THREADS
+    if (marker != NULL) {
+        tehssl_mark_later(marker, root);
+        return;
+    }
+    #else
+    (void)marker;
+    #endif
+    tehssl_markobject(vm, root);
+}
+
+void tehssl_markall(tehssl_vm_t vm, struct tehssl_marker* marker = NULL) {
+    tehssl_markroot(vm, marker, vm->stack);
+    tehssl_markroot(vm, marker, vm->return_value);
+    tehssl_markroot(vm, marker, vm->global_scope);
     DEBUG("Marking GC_STACK\n");
-    tehssl_markobject(vm, vm->gc_stack);
+    tehssl_markroot(vm, marker, vm->gc_stack);
     DEBUG("Done marking GC_STACK\n");
-    tehssl_markobject(vm, vm->type_functions);
-}
-
-void tehssl_sweep(tehssl_vm_t vm) {
-    tehssl_object_t* object = &vm->first_object;
-    while (*object != NULL) {
-        if (!tehssl_test_flag(*object, GC_MARK_TEMP) && !tehssl_test_flag(*object, GC_MARK_PERM)) {
-            tehssl_object_t unreached = *object;
-            *object = unreached->next_object;
-            DEBUG("Freeing a "); debug_print_type(unreached->type);
-            if (unreached->type == STREAM) {
-                DEBUG(" +FILE");
-                if (unreached->file != NULL) fclose(unreached->file);
-                unreached->file = NULL;
+    tehssl_markroot(vm, marker, vm->type_functions);
+    tehssl_markroot(vm, marker, vm->booleans[TRUE]);
+    tehssl_markroot(vm, marker, vm->booleans[FALSE]);
+    for (size_t i = 0; i < vm->return_depth; i++) {
+        tehssl_frame_t* frame = &vm->return_stack[i];
+        tehssl_markroot(vm, marker, frame->code);
+        tehssl_markroot(vm, marker, frame->line);
+        tehssl_markroot(vm, marker, frame->items);
+        tehssl_markroot(vm, marker, frame->scope);
+    }
+}
+
+// Runs between marking and sweeping. A stream's spare buffer that nothing marked has no views left
+// into it, so instead of being swept it is marked and handed back to the stream to refill. Streams
+// that weren't marked are about to be swept along with their buffers and are dropped from the list.
+void tehssl_reclaim_buffers(tehssl_vm_t vm) {
+    size_t kept = 0;
+    for (size_t i = 0; i < vm->num_retiring; i++) {
+        tehssl_object_t sobj = vm->retiring[i];
+        if (!tehssl_test_flag(sobj, GC_MARK_TEMP) && !tehssl_test_flag(sobj, GC_MARK_PERM)) continue;
+        tehssl_stream_t stream = sobj->stream;
+        tehssl_object_t spare = stream->spare;
+        if (spare != NULL && !tehssl_test_flag(spare, GC_MARK_TEMP) && !tehssl_test_flag(spare, GC_MARK_PERM)) {
+            DEBUG("Reclaimed a %zu byte stream buffer\n", spare->length);
+            tehssl_set_flag(spare, GC_MARK_TEMP);
+            stream->spare_free = true;
+        }
+        if (spare == NULL || stream->spare_free) stream->retiring = false;
+        else vm->retiring[kept++] = sobj;
+    }
+    vm->num_retiring = kept;
+}
+
+#ifdef TEHSSL_THREADS
+// The VM's thread is marker 0 and all the roots start out on its stack
+void tehssl_markall_parallel(tehssl_vm_t vm, size_t threads) {
+    struct tehssl_marking* marking = &vm->gc_helpers->marking;
+    for (size_t i = 0; i < threads; i++) {
+        struct tehssl_marker* marker = &marking->markers[i];
+        if (marker->capacity < 4 * TEHSSL_MARK_BATCH_SIZE) {
+            tehssl_object_t* items = (tehssl_object_t*)realloc(marker->items, 4 * TEHSSL_MARK_BATCH_SIZE * sizeof(tehssl_object_t));
+            if (items == NULL) {
+                tehssl_markall(vm);
+                return;
+            }
+            marker->items = items;
+            marker->capacity = 4 * TEHSSL_MARK_BATCH_SIZE;
+        }
+        marker->size = 0;
+        marker->scanned = 0;
+    }
+    marking->count = threads;
+    marking->idle = threads - 1;
+    marking->shared = 0;
+    tehssl_markall(vm, &marking->markers[0]);
+    tehssl_gc_run(vm, tehssl_mark_worker, marking->markers, sizeof(struct tehssl_marker), threads);
+}
+#endif
+
+// Sweeping
+// Rebuilds the free list from scratch. Each sweeper takes a run of whole pages and keeps its own free
+// list and counts, which are joined up afterwards. A page with nothing live on it is left off the free
+// list and freed once the sweep is done.
+struct tehssl_sweeper {
+    tehssl_vm_t vm;
+    size_t from, to; // pages
+    tehssl_object_t free_list;
+    tehssl_object_t* free_tail;
+    size_t freed_bytes;
+    size_t freed_objects;
+};
+
+void* tehssl_sweep_pages(void* arg) {
+    struct tehssl_sweeper* sweeper = (struct tehssl_sweeper*)arg;
+    sweeper->free_list = NULL;
+    sweeper->free_tail = &sweeper->free_list;
+    for (size_t p = sweeper->from; p < sweeper->to; p++) {
+        struct tehssl_page* page = sweeper->vm->pages[p];
+        tehssl_object_t free_list = NULL;
+        tehssl_object_t* free_tail = &free_list;
+        page->live = 0;
+        for (size_t i = 0; i < TEHSSL_PAGE_SIZE; i++) {
+            tehssl_object_t object = &page->objects[i];
+            if (tehssl_test_flag(object, GC_MARK_TEMP) || tehssl_test_flag(object, GC_MARK_PERM)) {
+                DEBUG("Skipping marked "); debug_print_type(object->type); DEBUG("\n");
+                tehssl_clear_flag(object, GC_MARK_TEMP);
+                page->live++;
+                continue;
             }
-            if (tehssl_get_cell_info(unreached) & CAR_STRING) {
-                DEBUG(" name-> \"%s\"", unreached->chars);
-                free(unreached->chars);
-                unreached->chars = NULL;
+            if (!tehssl_test_flag(object, FREE)) {
+                DEBUG("Freeing a "); debug_print_type(object->type);
+                sweeper->freed_bytes += tehssl_free_payload(object);
+                sweeper->freed_objects++;
+                DEBUG("\n");
+                object->flags = 1 << FREE;
             }
-            #ifdef TEHSSL_DEBUG
-            if (unreached->type == FLOAT) printf(" number-> %g", unreached->float_number);
-            if (unreached->type == SINGLETON) printf(" singleton-> %i", unreached->singleton);
-            if (*object == NULL) printf(", No next");
-            else { printf(", Next a "); debug_print_type((*object)->type); }
-            printf(": Now have %u objects\n", vm->num_objects - 1);
-            #endif
-            free(unreached);
-            vm->num_objects--;
-        } else {
-            DEBUG("Skipping marked "); debug_print_type((*object)->type); DEBUG("\n");
-            tehssl_clear_flag(*object, GC_MARK_TEMP);
-            object = &(*object)->next_object;
+            *free_tail = object;
+            free_tail = &object->next_free;
+        }
+        if (page->live == 0 || free_list == NULL) continue;
+        *sweeper->free_tail = free_list;
+        sweeper->free_tail = free_tail;
+    }
+    *sweeper->free_tail = NULL;
+    return NULL;
+}
+
+void tehssl_sweep(tehssl_vm_t vm, size_t threads) {
+    struct tehssl_sweeper single;
+    struct tehssl_sweeper* sweepers = threads > 1 ? (struct tehssl_sweeper*)calloc(threads, sizeof(struct tehssl_sweeper)) : NULL;
+    if (sweepers == NULL) {
+        threads = 1;
+        sweepers = &single;
+        memset(&single, 0, sizeof(single));
+    }
+    for (size_t i = 0; i < threads; i++) {
+        sweepers[i].vm = vm;
+        sweepers[i].from = vm->num_pages * i / threads;
+        sweepers[i].to = vm->num_pages * (i + 1) / threads;
+    }
+    #ifdef TEHSSL_THREADS
+    if (threads > 1) tehssl_gc_run(vm, tehssl_sweep_pages, sweepers, sizeof(struct tehssl_sweeper), threads);
+    else
+    #endif
+    tehssl_sweep_pages(&sweepers[0]);
+    tehssl_object_t* free_tail = &vm->free_list;
+    for (size_t i = 0; i < threads; i++) {
+        if (sweepers[i].free_list != NULL) {
+            *free_tail = sweepers[i].free_list;
+            free_tail = sweepers[i].free_tail;
+        }
+        vm->heap_bytes -= sweepers[i].freed_bytes;
+        vm->num_objects -= sweepers[i].freed_objects;
+    }
+    *free_tail = NULL;
+    if (sweepers != &single) free(sweepers);
+    #ifdef TEHSSL_JIT
+    // Before the empty pages go, since the cache is checked for lines that are now FREE
+    tehssl_jit_sweep(vm);
+    #endif
+    size_t kept = 0;
+    for (size_t p = 0; p < vm->num_pages; p++) {
+        if (vm->pages[p]->live != 0) vm->pages[kept++] = vm->pages[p];
+        else {
+            free(vm->pages[p]);
+            vm->heap_bytes -= sizeof(struct tehssl_page);
         }
     }
+    DEBUG("Freed %zu empty pages, %zu left\n", vm->num_pages - kept, kept);
+    vm->num_pages = kept;
+}
+
+// How many threads to collect with, starting the helpers if need be. A small heap isn't worth
+// handing out to threads.
+size_t tehssl_gc_workers(tehssl_vm_t vm) {
+    #ifdef TEHSSL_THREADS
+    if (vm->gc_helpers != NULL && vm->gc_helpers->wanted != vm->gc_threads) tehssl_gc_stop_helpers(vm);
+    if (vm->gc_threads <= 1 || vm->num_pages < TEHSSL_PARALLEL_GC_MIN_PAGES) return 1;
+    if (vm->gc_helpers == NULL) tehssl_gc_start_helpers(vm);
+    if (vm->gc_helpers == NULL) return 1;
+    size_t threads = vm->gc_helpers->count + 1;
+    return threads < vm->num_pages ? threads : vm->num_pages;
+    #else
+    (void)vm;
+    #endif
+    return 1;
+}
+
+// GC pacing
+// Sets how far the heap can grow before the next collection. The base is gc_target if that is set
+// and more than what survived, otherwise gc_growth times what survived. On top of that:
+//  * When most of the heap keeps surviving, collections are mostly wasted work, so the room is
+//    stretched by up to 2x (by the running average of the survival rate).
+//  * The room is never less than the mutator, allocating at the rate it did since the last
+//    collection, would fill in the time it takes to keep collections under TEHSSL_GC_MAX_OVERHEAD.
+//  * It is never less than one page, or TEHSSL_MIN_HEAP_SIZE objects' worth if that is more.
+//  * It never goes past heap_limit, so the quota is only hit when the live data really is that big.
+void tehssl_pace(tehssl_vm_t vm, size_t before, uint64_t mutator_time, uint64_t gc_time) {
+    size_t live = vm->heap_bytes;
+    double survival = before == 0 ? 0 : (double)live / before;
+    vm->gc_survival = (vm->gc_survival + survival) / 2;
+    size_t room;
+    if (vm->gc_target > live) room = vm->gc_target - live;
+    else room = (size_t)(live * (vm->gc_growth > 1 ? vm->gc_growth - 1 : 0) * (1 + vm->gc_survival));
+    if (mutator_time > 0 && gc_time > 0) {
+        double rate = (double)vm->allocated / mutator_time;
+        size_t paced = (size_t)(rate * gc_time * (1 - TEHSSL_GC_MAX_OVERHEAD) / TEHSSL_GC_MAX_OVERHEAD);
+        if (paced > room) room = paced;
+    }
+    if (room < tehssl_min_room()) room = tehssl_min_room();
+    vm->next_gc = live + room;
+    if (vm->heap_limit != 0 && vm->next_gc > vm->heap_limit) vm->next_gc = vm->heap_limit;
+    vm->allocated = 0;
+    DEBUG("%zu of %zu bytes survived, next GC at %zu bytes\n", live, before, vm->next_gc);
 }
 
 size_t tehssl_gc(tehssl_vm_t vm) {
@@ -318,125 +1180,364 @@ size_t tehssl_gc(tehssl_vm_t vm) {
         return 0;
     }
     DEBUG("Entering GC\n");
+    uint64_t start = TEHSSL_PAUSE_CLOCK();
+    // The VM may have moved to another thread since, whose clock is behind
+    uint64_t mutated = TEHSSL_MUTATOR_CLOCK();
+    mutated = mutated > vm->gc_clock ? mutated - vm->gc_clock : 0;
     size_t n = vm->num_objects;
+    size_t before = vm->heap_bytes;
+    size_t threads = tehssl_gc_workers(vm);
+    #ifdef TEHSSL_THREADS
+    if (threads > 1) tehssl_markall_parallel(vm, threads);
+    else
+    #endif
     tehssl_markall(vm);
-    tehssl_sweep(vm);
-    vm->next_gc = vm->num_objects == 0 ? TEHSSL_MIN_HEAP_SIZE : vm->num_objects * 2;
+    tehssl_reclaim_buffers(vm);
+    tehssl_sweep(vm, threads);
+    tehssl_pace(vm, before, mutated, TEHSSL_PAUSE_CLOCK() - start);
+    vm->gc_clock = TEHSSL_MUTATOR_CLOCK();
+    vm->gc_count++;
     size_t freed = n - vm->num_objects;
     DEBUG("GC done, freed %zu objects\n", freed);
     return freed;
 }
 
 void tehssl_destroy(tehssl_vm_t vm) {
-    while (vm->first_object != NULL) {
-        tehssl_object_t o = vm->first_object;
-        vm->first_object = o->next_object;
-        free(o);
+    #ifdef TEHSSL_THREADS
+    tehssl_gc_stop_helpers(vm);
+    #endif
+    #ifdef TEHSSL_JIT
+    tehssl_jit_free(vm);
+    #endif
+    tehssl_free_pages(vm->pages, vm->num_pages);
+    free(vm->pages);
+    free(vm->return_stack);
+    free(vm->retiring);
+    struct tehssl_swap* swap = vm->swaps;
+    while (swap != NULL) {
+        // Definitions that were never swapped in still own their pages
+        tehssl_free_pages(swap->pages, swap->num_pages);
+        free(swap->pages);
+        struct tehssl_swap* prev = swap->prev;
+        free(swap->name);
+        free(swap);
+        swap = prev;
     }
     free(vm);
 }
 
 // Push / Pop (for stacks)
-#define tehssl_push_t(vm, stack, item, t) do { tehssl_object_t cell = tehssl_alloc((vm), (t)); cell->value = item; cell->next = (stack); (stack) = cell; } while (false)
+#define tehssl_push_t(vm, stack, item, t) do { tehssl_object_t cell = tehssl_alloc((vm), (t)); if (cell == NULL) break; cell->value = item; cell->next = (stack); (stack) = cell; } while (false)
 #define tehssl_push(vm, stack, item) tehssl_push_t(vm, stack, item, CONS)
 #define tehssl_pop(stack) do { if ((stack) != NULL) (stack) = (stack)->next; } while (false)
 
 // Make objects
 tehssl_object_t tehssl_make_string(tehssl_vm_t vm, char* string) {
-    tehssl_object_t object = vm->first_object;
-    while (object != NULL) {
-        if (object->type == STRING && strcmp(object->chars, string) == 0) return object;
-        object = object->next_object;
+    size_t length = strlen(string);
+    tehssl_each_object(vm, object) {
+        if (object->type == STRING && tehssl_string_length(object) == length && memcmp(object->chars, string, length) == 0) return object;
     }
-    tehssl_object_t sobj = tehssl_alloc(vm, STRING);
-    sobj->chars = strdup(string);
-    return sobj;
+    return tehssl_alloc_string(vm, STRING, string, length);
 }
 
 #define SYMBOL_LITERAL true
 #define SYMBOL_WORD false
 tehssl_object_t tehssl_make_symbol(tehssl_vm_t vm, char* name, tehssl_symbol_type_t type) {
-    tehssl_object_t object = vm->first_object;
-    while (object != NULL) {
+    tehssl_each_object(vm, object) {
         if (object->type == SYMBOL && strcmp(object->chars, name) == 0 && object->symboltype == type) return object;
-        object = object->next_object;
     }
-    tehssl_object_t sobj = tehssl_alloc(vm, SYMBOL);
-    sobj->chars = strdup(name);
-    sobj->symboltype = type;
+    tehssl_object_t sobj = tehssl_alloc_string(vm, SYMBOL, name, strlen(name));
+    if (sobj != NULL) sobj->symboltype = type;
     return sobj;
 }
 
 tehssl_object_t tehssl_make_float(tehssl_vm_t vm, double n) {
-    tehssl_object_t object = vm->first_object;
-    while (object != NULL) {
-        if (object->type == FLOAT && (uint64_t)n == (uint64_t)object->float_number) return object;
-        object = object->next_object;
+    tehssl_each_object(vm, object) {
+        if (object->type == FLOAT && n == object->float_number) return object;
     }
     tehssl_object_t sobj = tehssl_alloc(vm, FLOAT);
-    sobj->float_number = n;
+    if (sobj != NULL) sobj->float_number = n;
+    return sobj;
+}
+
+tehssl_object_t tehssl_make_int(tehssl_vm_t vm, int64_t n) {
+    tehssl_each_object(vm, object) {
+        if (object->type == INT && n == object->int_number) return object;
+    }
+    tehssl_object_t sobj = tehssl_alloc(vm, INT);
+    if (sobj != NULL) sobj->int_number = n;
     return sobj;
 }
 
 tehssl_object_t tehssl_make_singleton(tehssl_vm_t vm, tehssl_singleton_t s) {
-    tehssl_object_t object = vm->first_object;
-    while (object != NULL) {
+    tehssl_each_object(vm, object) {
         if (object->type == SINGLETON && object->singleton == s) return object;
-        object = object->next_object;
     }
     tehssl_object_t sobj = tehssl_alloc(vm, SINGLETON);
-    sobj->singleton = s;
+    if (sobj != NULL) sobj->singleton = s;
     return sobj;
 }
 
-tehssl_object_t tehssl_make_stream(tehssl_vm_t vm, char* name, FILE* file) {
-    tehssl_object_t sobj = tehssl_alloc(vm, STREAM);
-    sobj->chars = strdup(name);
-    sobj->file = file;
-    return sobj;
+tehssl_object_t tehssl_make_buffer(tehssl_vm_t vm, size_t length) {
+    tehssl_object_t buffer = tehssl_alloc(vm, BUFFER, length);
+    if (buffer == NULL) return NULL;
+    buffer->chars = (char*)malloc(length);
+    if (buffer->chars == NULL) {
+        tehssl_uncharge(vm, length);
+        vm->status = OUT_OF_MEMORY;
+        return NULL;
+    }
+    buffer->length = length;
+    return buffer;
 }
 
-// Lookup values in scope
-#define FUN 0
-#define VAR 1
-#define MACRO 2
-tehssl_object_t tehssl_lookup(tehssl_object_t scope, char* name, uint8_t what) {
-    LOOKUP:
-    if (scope == NULL || scope->type != SCOPE) return NULL;
-    tehssl_object_t nn = scope->value;
-    while (name != NULL) {
-        if (strcmp(nn->chars, name) == 0) {
-            if ((what == FUN || what == MACRO) && (nn->value == NULL || nn->value->type != FUNCTION)) goto NEXT;
-            if (what == FUN && nn->value->functiontype != USERFUNCTION && nn->value->functiontype != BUILTIN) goto NEXT;
-            if (what == MACRO && nn->value->functiontype != MACRO && nn->value->functiontype != BUILTIN_MACRO) goto NEXT;
-            if (what == VAR && !tehssl_test_flag(nn, VARIABLE)) goto NEXT;
-            return nn->value;
+// Takes ownership of file; it is closed when the stream is garbage collected
+tehssl_object_t tehssl_make_stream(tehssl_vm_t vm, char* name, FILE* file) {
+    size_t length = strlen(name);
+    tehssl_object_t sobj = tehssl_alloc(vm, STREAM, length + 1 + sizeof(struct tehssl_stream));
+    if (sobj != NULL) {
+        sobj->chars = strndup(name, length);
+        sobj->stream = (tehssl_stream_t)calloc(1, sizeof(struct tehssl_stream));
+        if (sobj->chars != NULL && sobj->stream != NULL) {
+            sobj->stream->file = file;
+            return sobj;
         }
-        NEXT:
-        nn = nn->next;
+        // Left for the GC, charged for only what it got
+        if (sobj->chars == NULL) tehssl_uncharge(vm, length + 1);
+        if (sobj->stream == NULL) tehssl_uncharge(vm, sizeof(struct tehssl_stream));
+        vm->status = OUT_OF_MEMORY;
     }
-    scope = scope->parent;
-    goto LOOKUP;
+    if (file != NULL) fclose(file);
+    return NULL;
 }
 
-// Helper functions
-void tehssl_error(tehssl_vm_t vm, const char* message) {
-    vm->return_value = tehssl_make_string(vm, (char*)message);
-    vm->status = ERROR;
+// A stream over input that is already all in memory. Takes ownership of chars, which is
+// munmap()ed if mapped and free()d otherwise.
+tehssl_object_t tehssl_make_resident_stream(tehssl_vm_t vm, char* name, char* chars, size_t length, bool mapped) {
+    tehssl_object_t sobj = NULL;
+    tehssl_object_t buffer = NULL;
+    // Root the stream while its buffer is allocated
+    tehssl_push(vm, vm->gc_stack, NULL);
+    if (vm->status == OK) {
+        tehssl_object_t gc_cell = vm->gc_stack;
+        sobj = gc_cell->value = tehssl_make_stream(vm, name, NULL);
+        if (sobj != NULL) buffer = tehssl_alloc(vm, BUFFER, length);
+        vm->gc_stack = gc_cell->next;
+    }
+    if (buffer == NULL) {
+        #ifdef TEHSSL_MMAP
+        if (mapped) munmap(chars, length);
+        else
+        #endif
+        free(chars);
+        return NULL;
+    }
+    buffer->chars = chars;
+    buffer->length = length;
+    if (mapped) tehssl_set_flag(buffer, MAPPED);
+    sobj->stream->buffer = buffer;
+    sobj->stream->end = length;
+    return sobj;
 }
 
-void tehssl_error(tehssl_vm_t vm, const char* message, char* detail) {
-    char* buf;
-    asprintf(&buf, "%s: %s", message, detail);
-    vm->return_value = tehssl_alloc(vm, STRING);
-    vm->return_value->chars = buf;
-    vm->status = ERROR;
+tehssl_object_t tehssl_make_string_stream(tehssl_vm_t vm, char* name, const char* string) {
+    size_t length = strlen(string);
+    char* chars = (char*)malloc(length > 0 ? length : 1);
+    if (chars == NULL) {
+        vm->status = OUT_OF_MEMORY;
+        return NULL;
+    }
+    memcpy(chars, string, length);
+    return tehssl_make_resident_stream(vm, name, chars, length, false);
 }
 
-#define IFERR(vm) if ((vm)->status == ERROR || (vm)->status == OUT_OF_MEMORY)
-#define RIE(vm) do { IFERR(vm) return; } while (false)
-#define RNIE(vm) do { IFERR(vm) return NULL; } while (false)
-#define PRIE(vm, stack) do { IFERR(vm) { tehssl_pop(&(stack)); return; } } while (false)
+// mmap()s regular files if map is set, reads anything else through a buffer. Returns NULL if it
+// can't be opened.
+tehssl_object_t tehssl_open_stream(tehssl_vm_t vm, const char* path, bool map = true) {
+    #ifdef TEHSSL_MMAP
+    if (map) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return NULL;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            size_t length = st.st_size;
+            void* chars = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (chars != MAP_FAILED) {
+                madvise(chars, length, MADV_SEQUENTIAL);
+                return tehssl_make_resident_stream(vm, (char*)path, (char*)chars, length, true);
+            }
+        } else close(fd);
+    }
+    #else
+    (void)map;
+    #endif
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return NULL;
+    return tehssl_make_stream(vm, (char*)path, file);
+}
+
+// Reads more input, keeping the bytes from keep onwards; false at end of input.
+// The stream object must be rooted by the caller.
+bool tehssl_stream_fill(tehssl_vm_t vm, tehssl_object_t sobj, size_t keep) {
+    tehssl_stream_t stream = sobj->stream;
+    if (stream->file == NULL) return false;
+    size_t kept = stream->end - keep;
+    tehssl_object_t buffer = stream->buffer;
+    size_t size = kept * 2 > TEHSSL_STREAM_BUFFER_SIZE ? kept * 2 : TEHSSL_STREAM_BUFFER_SIZE;
+    if (buffer == NULL || stream->pinned || buffer->length < size) {
+        tehssl_object_t fresh = stream->spare_free && stream->spare->length >= size ? stream->spare : NULL;
+        if (fresh == NULL) {
+            DEBUG("New %zu byte stream buffer\n", size);
+            fresh = tehssl_make_buffer(vm, size);
+            if (fresh == NULL) return false;
+        }
+        if (kept > 0) memcpy(fresh->chars, buffer->chars + keep, kept);
+        if (fresh == stream->spare) {
+            stream->spare = NULL;
+            stream->spare_free = false;
+        }
+        if (stream->pinned) {
+            // Its views keep it alive until the GC finds them all gone and gives it back
+            if (!stream->retiring && vm->num_retiring == vm->retiring_capacity) {
+                size_t capacity = vm->retiring_capacity ? 2 * vm->retiring_capacity : 4;
+                tehssl_object_t* retiring = (tehssl_object_t*)realloc(vm->retiring, capacity * sizeof(tehssl_object_t));
+                if (retiring != NULL) {
+                    vm->retiring = retiring;
+                    vm->retiring_capacity = capacity;
+                }
+            }
+            if (!stream->retiring && vm->num_retiring < vm->retiring_capacity) {
+                vm->retiring[vm->num_retiring++] = sobj;
+                stream->retiring = true;
+            }
+            if (stream->retiring) {
+                stream->spare = buffer;
+                stream->spare_free = false;
+            }
+        }
+        stream->buffer = buffer = fresh;
+        stream->pinned = false;
+    } else if (kept > 0) {
+        memmove(buffer->chars, buffer->chars + keep, kept);
+    }
+    stream->start -= keep;
+    stream->end = kept;
+    size_t n = fread(buffer->chars + kept, 1, buffer->length - kept, stream->file);
+    stream->end += n;
+    return n > 0;
+}
+
+int tehssl_stream_getc(tehssl_vm_t vm, tehssl_object_t sobj) {
+    tehssl_stream_t stream = sobj->stream;
+    if (stream->start == stream->end && !tehssl_stream_fill(vm, sobj, stream->end)) return EOF;
+    return (unsigned char)stream->buffer->chars[stream->start++];
+}
+
+// Only the character just read can be put back
+void tehssl_stream_ungetc(tehssl_object_t sobj) {
+    if (sobj->stream->start > 0) sobj->stream->start--;
+}
+
+bool tehssl_stream_eof(tehssl_object_t sobj) {
+    tehssl_stream_t stream = sobj->stream;
+    return stream->start == stream->end && (stream->file == NULL || feof(stream->file));
+}
+
+// Returns the next line (without the line ending) as a STRING view into the stream's buffer,
+// or NULL at the end of the input. The stream object must be rooted by the caller.
+tehssl_object_t tehssl_read_line(tehssl_vm_t vm, tehssl_object_t sobj) {
+    tehssl_stream_t stream = sobj->stream;
+    size_t scanned = 0;
+    char* nl = NULL;
+    while (true) {
+        if (stream->buffer != NULL) {
+            char* from = stream->buffer->chars + stream->start + scanned;
+            nl = (char*)memchr(from, '\n', stream->end - stream->start - scanned);
+            if (nl != NULL) break;
+        }
+        scanned = stream->end - stream->start;
+        if (!tehssl_stream_fill(vm, sobj, stream->start)) break;
+    }
+    if (vm->status == OUT_OF_MEMORY) return NULL;
+    if (nl == NULL && stream->start == stream->end) return NULL;
+    char* line = stream->buffer->chars + stream->start;
+    size_t length = nl != NULL ? (size_t)(nl - line) : stream->end - stream->start;
+    stream->start += nl != NULL ? length + 1 : length;
+    if (length > 0 && line[length - 1] == '\r') length--;
+    tehssl_object_t view = tehssl_alloc(vm, STRING);
+    if (view == NULL) return NULL;
+    view->chars = line;
+    view->view_length = length;
+    view->owner = stream->buffer;
+    tehssl_set_flag(view, VIEW);
+    stream->pinned = true;
+    return view;
+}
+
+// Lookup values in scope
+#define FUN 0
+#define VAR 1
+#define MACRO 2
+tehssl_object_t tehssl_lookup(tehssl_object_t scope, char* name, uint8_t what) {
+    LOOKUP:
+    if (scope == NULL || scope->type != SCOPE) return NULL;
+    tehssl_object_t cell = scope->value;
+    while (cell != NULL) {
+        tehssl_object_t nn = cell->value;
+        if (strcmp(nn->chars, name) == 0) {
+            if ((what == FUN || what == MACRO) && (nn->binding == NULL || nn->binding->type != FUNCTION)) goto NEXT;
+            if (what == FUN && nn->binding->functiontype != USERFUNCTION && nn->binding->functiontype != BUILTIN) goto NEXT;
+            if (what == MACRO && nn->binding->functiontype != MACRO && nn->binding->functiontype != BUILTIN_MACRO) goto NEXT;
+            if (what == VAR && !tehssl_test_flag(nn, VARIABLE)) goto NEXT;
+            return nn->binding;
+        }
+        NEXT:
+        cell = cell->next;
+    }
+    scope = scope->parent;
+    goto LOOKUP;
+}
+
+// The NAME for name in scope itself (not its parents), or NULL
+tehssl_object_t tehssl_find_name(tehssl_object_t scope, const char* name) {
+    if (scope == NULL) return NULL;
+    for (tehssl_object_t cell = scope->value; cell != NULL; cell = cell->next) {
+        if (strcmp(cell->value->chars, name) == 0) return cell->value;
+    }
+    return NULL;
+}
+
+// The BUILTIN a word means in the global scope, if any
+tehssl_object_t tehssl_global_builtin(tehssl_vm_t vm, tehssl_object_t item) {
+    if (item == NULL || item->type != SYMBOL || item->symboltype != NORMAL) return NULL;
+    tehssl_object_t fun = tehssl_lookup(vm->global_scope, item->chars, FUN);
+    if (fun == NULL || fun->functiontype != BUILTIN) return NULL;
+    return fun;
+}
+
+// Helper functions
+// If there isn't even room for the message, the status is OUT_OF_MEMORY instead
+void tehssl_error(tehssl_vm_t vm, const char* message) {
+    vm->return_value = tehssl_make_string(vm, (char*)message);
+    vm->status = vm->return_value == NULL ? OUT_OF_MEMORY : ERROR;
+}
+
+void tehssl_error(tehssl_vm_t vm, const char* message, char* detail) {
+    char* buf;
+    vm->return_value = NULL;
+    if (asprintf(&buf, "%s: %s", message, detail) >= 0) {
+        vm->return_value = tehssl_alloc(vm, STRING, strlen(buf) + 1);
+        if (vm->return_value != NULL) vm->return_value->chars = buf;
+        else free(buf);
+    }
+    vm->status = vm->return_value == NULL ? OUT_OF_MEMORY : ERROR;
+}
+
+#define IFERR(vm) if ((vm)->status == ERROR || (vm)->status == OUT_OF_MEMORY)
+#define RIE(vm) do { IFERR(vm) return; } while (false)
+#define RNIE(vm) do { IFERR(vm) return NULL; } while (false)
+#define PRIE(vm, stack) do { IFERR(vm) { tehssl_pop(&(stack)); return; } } while (false)
 #define ERR(vm, msg) do { tehssl_error(vm, (msg)); return; } while (false) 
 #define ERR2(vm, msg, detail) do { tehssl_error(vm, (msg), (detail)); return; } while (false)
 
@@ -445,6 +1546,11 @@ bool tehssl_equal(tehssl_object_t a, tehssl_object_t b) {
     if (a == b) return true; // Same object
     if (a == NULL || b == NULL) return false; // Null
     if (a->type != b->type) return false; // Different type
+    if (a->type == STRING) {
+        // Views compare by contents, not owner
+        size_t length = tehssl_string_length(a);
+        return tehssl_string_length(b) == length && memcmp(a->chars, b->chars, length) == 0;
+    }
     uint8_t info = tehssl_get_cell_info(a);
     if (info & 0b100 && strcmp(a->chars, b->chars) != 0) return false;
     if (info & 0b010 && !tehssl_equal(a->car, b->car)) return false;
@@ -492,7 +1598,7 @@ void tehssl_list_set(tehssl_object_t list, int i, tehssl_object_t new_value) {
 // Tokenizer
 #define TEHSSL_SPECIAL_CHARS "{}[]();"
 // Returns empty string on eof, NULL on error
-char* tehssl_next_token(FILE* file) {
+char* tehssl_next_token(tehssl_vm_t vm, tehssl_object_t stream) {
     char* buffer = (char*)malloc(TEHSSL_CHUNK_SIZE);
     memset(buffer, 0, TEHSSL_CHUNK_SIZE);
     size_t buffersz = TEHSSL_CHUNK_SIZE;
@@ -501,7 +1607,7 @@ char* tehssl_next_token(FILE* file) {
     bool string = false;
     bool informal = false;
     NEXTCHAR:
-    char ch = fgetc(file);
+    int ch = tehssl_stream_getc(vm, stream);
     // if (ch != EOF) printf("\ni=%d CH=%c: ", i, ch); else printf("ch=EOF, ");
     if (comment || informal) {
         // printf("c, ");
@@ -522,7 +1628,7 @@ char* tehssl_next_token(FILE* file) {
         string = !string;
         if (i > 0) {
             // printf("i>0, ");
-            if (string) ungetc(ch, file);
+            if (string) tehssl_stream_ungetc(stream);
             goto DONE;
         }
     }
@@ -536,7 +1642,7 @@ char* tehssl_next_token(FILE* file) {
         // no other char -> return paren as token
         if (i == 0) buffer[0] = ch;
         // other chars -> back up, stop, return what we've got so far
-        else ungetc(ch, file);
+        else tehssl_stream_ungetc(stream);
         goto DONE;
     }
     if (i == 0 && 'a' <= ch && ch <= 'z') {
@@ -570,122 +1676,222 @@ char* tehssl_next_token(FILE* file) {
 }
 
 // Compiler
-tehssl_object_t tehssl_compile_until(tehssl_vm_t vm, FILE* stream, char stop) {
-    tehssl_gc(vm);
-    bool oldenable = vm->enable_gc;
-    vm->enable_gc = false;
-    tehssl_object_t c_block = tehssl_alloc(vm, BLOCK);
-    tehssl_object_t* block_tail = &c_block;
-    IFERR(vm) goto ERROR;
-    // Outer loop: Lines
-    while (!feof(stream)) {
-        DEBUG("Top of Outer loop\n");
-        tehssl_object_t c_line = tehssl_alloc(vm, LINE);
-        tehssl_object_t* line_tail = &c_line;
-        IFERR(vm) goto ERROR;
-        char* token = NULL;
-        // Inner loop: items on the line
-        while (!feof(stream)) {
-            DEBUG("Top of Inner loop\n");
-            token = tehssl_next_token(stream);
-            if (token == NULL) {
-                DEBUG("Unexpected EOF\n");
-                tehssl_error(vm, "unexpected EOF");
-                vm->enable_gc = oldenable;
-                return NULL;
-            }
-            if ((strlen(token) == 0 && stop == EOF) || token[0] == stop) {
-                DEBUG("Hit Stop, returning\n");
+// Skips to the } matching a { that was just read; false if there isn't one. With a unit, the words
+// bound with Def or Let anywhere in the block go on the unit's list of names.
+bool tehssl_skip_block(tehssl_vm_t vm, tehssl_object_t stream, tehssl_object_t unit = NULL) {
+    size_t depth = 1;
+    bool binds = false;
+    while (depth > 0) {
+        char* token = tehssl_next_token(vm, stream);
+        if (token == NULL || strlen(token) == 0) {
+            free(token);
+            tehssl_error(vm, "unexpected EOF");
+            return false;
+        }
+        if (token[0] == '{') depth++;
+        else if (token[0] == '}') depth--;
+        else if (unit != NULL && binds && token[0] != ';' && token[0] != '"' && (token[1] == '\0' || strchr(":-&%+", token[0]) == NULL)) {
+            tehssl_push(vm, unit->cdr, NULL);
+            if (vm->status == OK) unit->cdr->value = tehssl_make_symbol(vm, token, NORMAL);
+            if (vm->status != OK) {
                 free(token);
-                vm->enable_gc = oldenable;
-                return c_block;
+                return false;
             }
-            tehssl_object_t item = NULL;
-            if (token[0] == ';') {
-                DEBUG("Semicolon\n");
-                free(token);
-                break;
+        }
+        binds = strcmp(token, "Def") == 0 || strcmp(token, "Let") == 0;
+        free(token);
+    }
+    return true;
+}
+
+// Compiles code into a tree of BLOCK and LINE objects, up to the stop character.
+// With COMPILE_LAZY, nested blocks read from a resident stream are only checked for matching
+// brackets and become LAZY objects recording where they start; tehssl_force() compiles them.
+// All the LAZY blocks of a unit share its CONS: the source BUFFER, and the list of SYMBOLs bound
+// with Def or Let around them, so that the optimizer leaves those alone when they are forced.
+// The stream object must be rooted by the caller
+tehssl_object_t tehssl_compile_until(tehssl_vm_t vm, tehssl_object_t stream, char stop, uint8_t options = 0, tehssl_object_t unit = NULL) {
+    tehssl_object_t old_gc_stack = vm->gc_stack;
+    if (unit == NULL && (options & COMPILE_LAZY) && stream->stream->file == NULL) {
+        tehssl_push(vm, vm->gc_stack, NULL);
+        RNIE(vm);
+        unit = vm->gc_stack->value = tehssl_alloc(vm, CONS);
+        IFERR(vm) {
+            vm->gc_stack = old_gc_stack;
+            return NULL;
+        }
+        unit->car = stream->stream->buffer;
+    }
+    // The GC stays on: everything compiled so far hangs off gc_cell, and each LINE cell is
+    // allocated (and linked in) before the item that goes in it.
+    tehssl_push(vm, vm->gc_stack, NULL);
+    IFERR(vm) {
+        vm->gc_stack = old_gc_stack;
+        return NULL;
+    }
+    tehssl_object_t gc_cell = vm->gc_stack;
+    tehssl_object_t* block_tail = &gc_cell->value;
+    tehssl_object_t* line_tail = NULL; // NULL between lines
+    while (true) {
+        DEBUG("Top of compile loop\n");
+        char* token = tehssl_next_token(vm, stream);
+        if (token == NULL || (strlen(token) == 0 && stop != EOF)) {
+            DEBUG("Unexpected EOF\n");
+            free(token);
+            tehssl_error(vm, "unexpected EOF");
+            goto ERROR;
+        }
+        bool done = (strlen(token) == 0 && stop == EOF) || token[0] == stop;
+        if (done || token[0] == ';') {
+            // Finish the current line
+            free(token);
+            if (line_tail != NULL) {
+                DEBUG("End of line\n");
+                block_tail = &(*block_tail)->next;
+                line_tail = NULL;
             }
-            else if (token[0] == '{') {
+            if (!done) continue;
+            DEBUG("Hit Stop, returning\n");
+            // An empty block is still a block, not Null
+            if (gc_cell->value == NULL) gc_cell->value = tehssl_alloc(vm, BLOCK);
+            IFERR(vm) goto ERROR;
+            // Optimize the whole unit at once so Defs are visible everywhere in it
+            if (stop == EOF && (options & COMPILE_OPTIMIZE)) tehssl_optimize_unit(vm, gc_cell->value, unit);
+            IFERR(vm) goto ERROR;
+            break;
+        }
+        if (token[0] == '}') {
+            free(token);
+            tehssl_error(vm, "unexpected }");
+            goto ERROR;
+        }
+        if (line_tail == NULL) {
+            *block_tail = tehssl_alloc(vm, BLOCK);
+            if (*block_tail == NULL) {
                 free(token);
-                DEBUG("Bracket\n");
-                item = tehssl_compile_until(vm, stream, '}');
+                goto ERROR;
             }
-            else {
-                // literal
-                double num;
-                if (sscanf(token, "%lf", &num) == 1) {
-                    DEBUG("Number: %g\n", num);
-                    item = tehssl_make_float(vm, num);
-                } else if (strcmp(token, "True") == 0) {
-                    DEBUG("TRUE literal\n");
-                    item = tehssl_make_singleton(vm, TRUE);
-                } else if (strcmp(token, "False") == 0) {
-                    DEBUG("FALSE literal\n");
-                    item = tehssl_make_singleton(vm, FALSE);
-                } else if (strcmp(token, "Undefined") == 0) {
-                    DEBUG("UNDEFINED literal\n");
-                    item = tehssl_make_singleton(vm, UNDEFINED);
-                } else if (strcmp(token, "DNE") == 0) {
-                    DEBUG("DNE literal\n");
-                    item = tehssl_make_singleton(vm, DNE);
-                } else if (strcmp(token, "Null") == 0) {
-                    DEBUG("Null literal\n");
-                    // item is already NULL
-                } else if (token[0] == '"') {
-                    DEBUG("String: %s\n", token + 1);
-                    item = tehssl_make_string(vm, token + 1);
-                } else if (token[0]  == ':') {
-                    DEBUG("Literal symbol: %s\n", token + 1);
-                    item = tehssl_make_symbol(vm, token + 1, LITERAL);
-                } else if (token[0]  == '-') {
-                    DEBUG("KW symbol: %s\n", token + 1);
-                    item = tehssl_make_symbol(vm, token + 1, KEYWORD_ADD);
-                } else if (token[0]  == '&') {
-                    DEBUG("Look symbol: %s\n", token + 1);
-                    item = tehssl_make_symbol(vm, token + 1, KEYWORD_LOOK);
-                } else if (token[0]  == '%') {
-                    DEBUG("Pop symbol: %s\n", token + 1);
-                    item = tehssl_make_symbol(vm, token + 1, KEYWORD_POP);
-                } else if (token[0]  == '+') {
-                    DEBUG("Flag symbol: %s\n", token + 1);
-                    item = tehssl_make_symbol(vm, token + 1, KEYWORD_FLAG);
-                } else {
-                    DEBUG("Normal symbol: %s\n", token);
-                    item = tehssl_make_symbol(vm, token, NORMAL);
-                }
-                free(token);
-                *line_tail = tehssl_alloc(vm, LINE);
+            line_tail = &(*block_tail)->value;
+        }
+        *line_tail = tehssl_alloc(vm, LINE);
+        if (*line_tail == NULL) {
+            free(token);
+            goto ERROR;
+        }
+        tehssl_object_t* item = &(*line_tail)->value;
+        line_tail = &(*line_tail)->next;
+        if (token[0] == '{') {
+            free(token);
+            if ((options & COMPILE_LAZY) && stream->stream->file == NULL) {
+                DEBUG("Lazy bracket\n");
+                size_t start = stream->stream->start;
+                if (!tehssl_skip_block(vm, stream, (options & COMPILE_OPTIMIZE) ? unit : NULL)) goto ERROR;
+                *item = tehssl_alloc(vm, LAZY);
+                IFERR(vm) goto ERROR;
+                (*item)->value = unit;
+                (*item)->offset = start;
+                if (options & COMPILE_OPTIMIZE) tehssl_set_flag(*item, OPTIMIZE);
+            } else {
+                DEBUG("Bracket\n");
+                *item = tehssl_compile_until(vm, stream, '}', options, unit);
                 IFERR(vm) goto ERROR;
-                (*line_tail)->value = item;
-                line_tail = &(*line_tail)->next;
             }
-            
-            DEBUG("Bottom of outer loop\n");
-            *block_tail = tehssl_alloc(vm, BLOCK);
-            (*block_tail)->value = c_line;
-            block_tail = &(*block_tail)->next;
+        }
+        else {
+            // literal
+            double num;
+            int used = 0;
+            if (sscanf(token, "%lf%n", &num, &used) == 1 && token[used] == '\0') {
+                DEBUG("Number: %g\n", num);
+                *item = tehssl_make_float(vm, num);
+            } else if (strcmp(token, "True") == 0) {
+                DEBUG("TRUE literal\n");
+                *item = tehssl_make_singleton(vm, TRUE);
+            } else if (strcmp(token, "False") == 0) {
+                DEBUG("FALSE literal\n");
+                *item = tehssl_make_singleton(vm, FALSE);
+            } else if (strcmp(token, "Undefined") == 0) {
+                DEBUG("UNDEFINED literal\n");
+                *item = tehssl_make_singleton(vm, UNDEFINED);
+            } else if (strcmp(token, "DNE") == 0) {
+                DEBUG("DNE literal\n");
+                *item = tehssl_make_singleton(vm, DNE);
+            } else if (strcmp(token, "Null") == 0) {
+                DEBUG("Null literal\n");
+                // *item is already NULL
+            } else if (token[0] == '"') {
+                DEBUG("String: %s\n", token + 1);
+                *item = tehssl_make_string(vm, token + 1);
+            } else if (token[1] == '\0') {
+                // A sigil on its own (+, -, ...) is an ordinary word
+                DEBUG("Normal symbol: %s\n", token);
+                *item = tehssl_make_symbol(vm, token, NORMAL);
+            } else if (token[0]  == ':') {
+                DEBUG("Literal symbol: %s\n", token + 1);
+                *item = tehssl_make_symbol(vm, token + 1, LITERAL);
+            } else if (token[0]  == '-') {
+                DEBUG("KW symbol: %s\n", token + 1);
+                *item = tehssl_make_symbol(vm, token + 1, KEYWORD_ADD);
+            } else if (token[0]  == '&') {
+                DEBUG("Look symbol: %s\n", token + 1);
+                *item = tehssl_make_symbol(vm, token + 1, KEYWORD_LOOK);
+            } else if (token[0]  == '%') {
+                DEBUG("Pop symbol: %s\n", token + 1);
+                *item = tehssl_make_symbol(vm, token + 1, KEYWORD_POP);
+            } else if (token[0]  == '+') {
+                DEBUG("Flag symbol: %s\n", token + 1);
+                *item = tehssl_make_symbol(vm, token + 1, KEYWORD_FLAG);
+            } else {
+                DEBUG("Normal symbol: %s\n", token);
+                *item = tehssl_make_symbol(vm, token, NORMAL);
+            }
+            free(token);
+            IFERR(vm) goto ERROR;
         }
     }
-    DEBUG("feof() false, returning\n");
+    vm->gc_stack = old_gc_stack;
+    return gc_cell->value;
     ERROR:
-    vm->enable_gc = oldenable;
-    RNIE(vm);
-    return c_block;
+    vm->gc_stack = old_gc_stack;
+    return NULL;
 }
 
-// Reverse a line
-tehssl_object_t tehssl_reverse_line(tehssl_vm_t vm, tehssl_object_t line) {
-    DEBUG("Reversing a line\n");
-    tehssl_object_t reversed = NULL;
-    while (line != NULL) {
-        tehssl_push(vm, reversed, line->value);
-        RNIE(vm);
-        line = line->next;
+// Compiles a LAZY block in place, so it becomes the BLOCK it would have been.
+// The object must be rooted by the caller.
+void tehssl_force(tehssl_vm_t vm, tehssl_object_t block) {
+    if (block == NULL || block->type != LAZY) return;
+    DEBUG("Compiling a lazy block\n");
+    tehssl_object_t old_gc_stack = vm->gc_stack;
+    tehssl_object_t compiled = NULL;
+    // A unit of its own, with everything bound around the block bound around the blocks in it too
+    tehssl_push(vm, vm->gc_stack, NULL);
+    tehssl_object_t unit = vm->status == OK ? vm->gc_stack->value = tehssl_alloc(vm, CONS) : NULL;
+    tehssl_object_t gc_cell = NULL;
+    if (unit != NULL) {
+        unit->car = block->value->car;
+        unit->cdr = block->value->cdr;
+        tehssl_push(vm, vm->gc_stack, NULL);
+        if (vm->status == OK) {
+            gc_cell = vm->gc_stack;
+            gc_cell->value = tehssl_make_stream(vm, (char*)"block", NULL);
+        }
+    }
+    if (gc_cell != NULL && gc_cell->value != NULL) {
+        tehssl_stream_t stream = gc_cell->value->stream;
+        stream->buffer = unit->car;
+        stream->start = block->offset;
+        stream->end = unit->car->length;
+        // Blocks nested in an optimized one are optimized too when they are forced
+        uint8_t options = COMPILE_LAZY | (tehssl_test_flag(block, OPTIMIZE) ? COMPILE_OPTIMIZE : 0);
+        compiled = gc_cell->value = tehssl_compile_until(vm, gc_cell->value, '}', options, unit);
+        if (vm->status == OK && (options & COMPILE_OPTIMIZE)) tehssl_optimize_unit(vm, compiled, unit);
     }
-    
-    DEBUG("Done reversing a line\n");
-    return reversed;
+    vm->gc_stack = old_gc_stack;
+    RIE(vm);
+    block->type = BLOCK;
+    tehssl_clear_flag(block, OPTIMIZE);
+    block->value = compiled->value;
+    block->next = compiled->next;
 }
 
 #ifndef yield
@@ -693,73 +1899,444 @@ tehssl_object_t tehssl_reverse_line(tehssl_vm_t vm, tehssl_object_t line) {
 #endif
 
 // Evaluator
+// Calls are not made by recursing in C. Each running block gets a frame on vm->return_stack
+// and the loop below always works on the top frame, so deep recursion costs heap, not C stack.
+// A call made by the last item of the last line of a block replaces its frame instead of
+// pushing a new one, so tail recursion runs in a constant amount of both.
+void tehssl_enter(tehssl_vm_t vm, tehssl_object_t block, tehssl_object_t scope, bool tail) {
+    if (!tail) {
+        if (vm->return_depth >= TEHSSL_MAX_RETURN_DEPTH) ERR(vm, "too much recursion");
+        if (vm->return_depth == vm->return_capacity) {
+            size_t capacity = vm->return_capacity == 0 ? 16 : vm->return_capacity * 2;
+            tehssl_frame_t* frames = (tehssl_frame_t*)realloc(vm->return_stack, capacity * sizeof(tehssl_frame_t));
+            if (frames == NULL) {
+                vm->status = OUT_OF_MEMORY;
+                return;
+            }
+            vm->return_stack = frames;
+            vm->return_capacity = capacity;
+        }
+        vm->return_depth++;
+    }
+    DEBUG("%s frame %zu\n", tail ? "Reusing" : "Entering", vm->return_depth);
+    tehssl_frame_t* frame = &vm->return_stack[vm->return_depth - 1];
+    frame->code = block;
+    frame->line = NULL;
+    frame->items = NULL;
+    frame->scope = scope;
+}
+
+void tehssl_push_closure(tehssl_vm_t vm, tehssl_object_t block, tehssl_object_t scope) {
+    tehssl_push(vm, vm->stack, NULL);
+    RIE(vm);
+    tehssl_object_t closure = tehssl_alloc(vm, CLOSURE);
+    RIE(vm);
+    closure->scope = scope;
+    closure->code = block;
+    vm->stack->value = closure;
+}
+
+// Macro-expands the line and reverses it onto frame->items
+void tehssl_prepare_line(tehssl_vm_t vm, tehssl_frame_t* frame) {
+    frame->line = frame->code->value;
+    frame->code = frame->code->next;
+    while (frame->line != NULL) {
+        tehssl_object_t item = frame->line->value;
+        if (item != NULL && item->type == SYMBOL && item->symboltype == NORMAL) {
+            tehssl_object_t macro = tehssl_lookup(frame->scope, item->chars, MACRO);
+            if (macro != NULL && macro->functiontype == BUILTIN_MACRO) {
+                // The macro gets the rest of the line on the stack and leaves what's left of it there
+                DEBUG("Expanding macro %s\n", item->chars);
+                tehssl_push(vm, vm->stack, frame->line->next);
+                RIE(vm);
+                vm->calls++;
+                macro->c_function(vm, frame->scope);
+                RIE(vm);
+                if (vm->stack == NULL) ERR(vm, "stack underflow");
+                frame->line = vm->stack->value;
+                tehssl_pop(vm->stack);
+                continue;
+            }
+        }
+        tehssl_push(vm, frame->items, item);
+        RIE(vm);
+        frame->line = frame->line->next;
+    }
+}
+
+#ifdef TEHSSL_JIT
+// JIT
+// A copy-and-patch compiler for single lines. Each kind of item has a stencil: a few
+// instructions of hand-assembled x86-64 with holes for the item's index, operands, the helper
+// or builtin to call, and the jump to the shared exit. Compiling a line copies one stencil per
+// item (right to left, like the evaluator) into an executable arena and fills in the holes.
+//
+// The compiled line returns how many items it finished. It stops early, leaving the rest of the
+// line to the interpreter, when an item needs a frame (a user function), when a builtin's
+// binding has changed since it was compiled, or when a builtin sets a status.
+// Lines containing macros or keyword symbols aren't compiled at all.
+//
+// rbx = vm, r12 = scope, r13d = number of items finished so far (the return value).
+
+static const uint8_t tehssl_jit_prologue[] = {
+    0x53,                   // push rbx
+    0x41, 0x54,             // push r12
+    0x41, 0x55,             // push r13
+    0x48, 0x89, 0xfb,       // mov rbx, rdi
+    0x49, 0x89, 0xf4,       // mov r12, rsi
+};
+
+static const uint8_t tehssl_jit_epilogue[] = {
+    0x41, 0xbd, 0, 0, 0, 0, // mov r13d, <index>
+    // exit:
+    0x44, 0x89, 0xe8,       // mov eax, r13d
+    0x41, 0x5d,             // pop r13
+    0x41, 0x5c,             // pop r12
+    0x5b,                   // pop rbx
+    0xc3,                   // ret
+};
+
+// helper(vm, operand, scope), stop if it returns nonzero
+static const uint8_t tehssl_jit_operand[] = {
+    0x41, 0xbd, 0, 0, 0, 0, // mov r13d, <index>
+    0x48, 0x89, 0xdf,       // mov rdi, rbx
+    0x48, 0xbe, 0, 0, 0, 0, 0, 0, 0, 0, // mov rsi, <operand>
+    0x4c, 0x89, 0xe2,       // mov rdx, r12
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, // mov rax, <target>
+    0xff, 0xd0,             // call rax
+    0x85, 0xc0,             // test eax, eax
+    0x0f, 0x85, 0, 0, 0, 0, // jnz exit
+};
+
+// guard(vm, symbol, scope, builtin), stop if it returns nonzero
+static const uint8_t tehssl_jit_guard[] = {
+    0x41, 0xbd, 0, 0, 0, 0, // mov r13d, <index>
+    0x48, 0x89, 0xdf,       // mov rdi, rbx
+    0x48, 0xbe, 0, 0, 0, 0, 0, 0, 0, 0, // mov rsi, <operand>
+    0x4c, 0x89, 0xe2,       // mov rdx, r12
+    0x48, 0xb9, 0, 0, 0, 0, 0, 0, 0, 0, // mov rcx, <operand2>
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, // mov rax, <target>
+    0xff, 0xd0,             // call rax
+    0x85, 0xc0,             // test eax, eax
+    0x0f, 0x85, 0, 0, 0, 0, // jnz exit
+};
+
+// builtin(vm, scope), stop if it set vm->status
+static const uint8_t tehssl_jit_call[] = {
+    0x48, 0x89, 0xdf,       // mov rdi, rbx
+    0x4c, 0x89, 0xe6,       // mov rsi, r12
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, // mov rax, <target>
+    0xff, 0xd0,             // call rax
+    0x41, 0xbd, 0, 0, 0, 0, // mov r13d, <index>
+    0x83, 0xbb, 0, 0, 0, 0, 0x00, // cmp dword [rbx + <status>], OK
+    0x0f, 0x85, 0, 0, 0, 0, // jnz exit
+};
+
+// Offsets of the holes in each stencil, -1 if it doesn't have one
+struct tehssl_stencil {
+    const uint8_t* bytes;
+    size_t size;
+    int8_t index;
+    int8_t operand;
+    int8_t operand2;
+    int8_t target;
+    int8_t status;
+    int8_t exit;
+};
+
+static const struct tehssl_stencil tehssl_stencil_operand = { tehssl_jit_operand, sizeof(tehssl_jit_operand), 2, 11, -1, 24, -1, 38 };
+static const struct tehssl_stencil tehssl_stencil_guard = { tehssl_jit_guard, sizeof(tehssl_jit_guard), 2, 11, 24, 34, -1, 48 };
+static const struct tehssl_stencil tehssl_stencil_call = { tehssl_jit_call, sizeof(tehssl_jit_call), 20, -1, -1, 8, 26, 33 };
+
+// Helpers called from compiled code
+uint32_t tehssl_jit_push(tehssl_vm_t vm, tehssl_object_t item, tehssl_object_t scope) {
+    (void)scope;
+    tehssl_push(vm, vm->stack, item);
+    return vm->status != OK;
+}
+
+uint32_t tehssl_jit_closure(tehssl_vm_t vm, tehssl_object_t block, tehssl_object_t scope) {
+    tehssl_push_closure(vm, block, scope);
+    return vm->status != OK;
+}
+
+// Pushes a variable; anything else is left to the interpreter
+uint32_t tehssl_jit_variable(tehssl_vm_t vm, tehssl_object_t symbol, tehssl_object_t scope) {
+    tehssl_object_t var = tehssl_lookup(scope, symbol->chars, VAR);
+    if (var == NULL) return 1;
+    tehssl_push(vm, vm->stack, var);
+    return vm->status != OK;
+}
+
+// Checks the word still means the builtin it meant when the line was compiled. nn is the global
+// NAME it was looked up as then. Every scope ends in the global one, so while no other scope has
+// ever bound the name and the NAME still holds the builtin, the lookup would find it there; only
+// otherwise are the interpreter's lookups redone.
+uint32_t tehssl_jit_check(tehssl_vm_t vm, tehssl_object_t nn, tehssl_object_t scope, tehssl_fun_t fn) {
+    // Runs right before every builtin the JIT calls
+    vm->calls++;
+    tehssl_object_t fun = nn->binding;
+    bool builtin = !tehssl_test_flag(nn, VARIABLE) && fun != NULL && fun->type == FUNCTION && fun->functiontype == BUILTIN && fun->c_function == fn;
+    if (builtin && !tehssl_test_flag(nn, SHADOWED)) return 0;
+    if (tehssl_lookup(scope, nn->chars, VAR) != NULL) return 1;
+    fun = tehssl_lookup(scope, nn->chars, FUN);
+    return fun == NULL || fun->functiontype != BUILTIN || fun->c_function != fn;
+}
+
+uint8_t* tehssl_jit_emit(uint8_t* at, uint8_t* exit, const struct tehssl_stencil* stencil, uint32_t index, const void* operand, const void* operand2, const void* target) {
+    memcpy(at, stencil->bytes, stencil->size);
+    if (stencil->index >= 0) memcpy(at + stencil->index, &index, sizeof(index));
+    if (stencil->operand >= 0) memcpy(at + stencil->operand, &operand, sizeof(operand));
+    if (stencil->operand2 >= 0) memcpy(at + stencil->operand2, &operand2, sizeof(operand2));
+    if (stencil->target >= 0) memcpy(at + stencil->target, &target, sizeof(target));
+    if (stencil->status >= 0) {
+        int32_t status = offsetof(struct tehssl_vm, status);
+        memcpy(at + stencil->status, &status, sizeof(status));
+    }
+    int32_t rel = (int32_t)(exit - (at + stencil->exit + 4));
+    memcpy(at + stencil->exit, &rel, sizeof(rel));
+    return at + stencil->size;
+}
+
+struct tehssl_jit_entry* tehssl_jit_slot(tehssl_vm_t vm, tehssl_object_t line) {
+    return &vm->jit_cache[((uintptr_t)line / sizeof(struct tehssl_object)) & (TEHSSL_JIT_CACHE_SIZE - 1)];
+}
+
+// Drops the lines the sweep just freed
+void tehssl_jit_sweep(tehssl_vm_t vm) {
+    if (vm->jit_cache == NULL) return;
+    for (size_t i = 0; i < TEHSSL_JIT_CACHE_SIZE; i++) {
+        if (vm->jit_cache[i].line != NULL && tehssl_test_flag(vm->jit_cache[i].line, FREE)) vm->jit_cache[i].line = NULL;
+    }
+}
+
+void tehssl_jit_free(tehssl_vm_t vm) {
+    if (vm->jit_arena != NULL) munmap(vm->jit_arena, TEHSSL_JIT_ARENA_SIZE);
+    free(vm->jit_cache);
+    vm->jit_arena = NULL;
+    vm->jit_cache = NULL;
+}
+
+tehssl_jit_fun_t tehssl_jit_compile(tehssl_vm_t vm, tehssl_object_t line) {
+    size_t n = 0;
+    size_t size = sizeof(tehssl_jit_prologue) + sizeof(tehssl_jit_epilogue);
+    for (tehssl_object_t l = line; l != NULL; l = l->next, n++) {
+        tehssl_object_t item = l->value;
+        if (item == NULL || item->type != SYMBOL) size += tehssl_stencil_operand.size;
+        else if (item->symboltype != NORMAL || tehssl_lookup(vm->global_scope, item->chars, MACRO) != NULL) return NULL;
+        else if (tehssl_global_builtin(vm, item) != NULL) size += tehssl_stencil_guard.size + tehssl_stencil_call.size;
+        else size += tehssl_stencil_operand.size;
+    }
+    if (n == 0) return NULL;
+    // Right to left; the index is how many items are finished before this one
+    tehssl_object_t* items = (tehssl_object_t*)malloc(n * sizeof(tehssl_object_t));
+    if (items == NULL) return NULL;
+    size_t i = 0;
+    for (tehssl_object_t l = line; l != NULL; l = l->next) items[i++] = l->value;
+    if (vm->jit_used + size > TEHSSL_JIT_ARENA_SIZE) {
+        // Out of room: start over, unless compiled code is running right now
+        if (size > TEHSSL_JIT_ARENA_SIZE) {
+            free(items);
+            return NULL;
+        }
+        DEBUG("JIT arena full, flushing\n");
+        memset(vm->jit_cache, 0, TEHSSL_JIT_CACHE_SIZE * sizeof(struct tehssl_jit_entry));
+        vm->jit_used = 0;
+    }
+    if (mprotect(vm->jit_arena, TEHSSL_JIT_ARENA_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        free(items);
+        return NULL;
+    }
+    uint8_t* start = vm->jit_arena + vm->jit_used;
+    uint8_t* exit = start + size - sizeof(tehssl_jit_epilogue) + 6;
+    uint8_t* at = start;
+    memcpy(at, tehssl_jit_prologue, sizeof(tehssl_jit_prologue));
+    at += sizeof(tehssl_jit_prologue);
+    for (uint32_t done = 0; done < n; done++) {
+        tehssl_object_t item = items[n - 1 - done];
+        if (tehssl_is_block(item)) {
+            at = tehssl_jit_emit(at, exit, &tehssl_stencil_operand, done, item, NULL, (const void*)tehssl_jit_closure);
+        } else if (item == NULL || item->type != SYMBOL) {
+            at = tehssl_jit_emit(at, exit, &tehssl_stencil_operand, done, item, NULL, (const void*)tehssl_jit_push);
+        } else {
+            tehssl_object_t fun = tehssl_global_builtin(vm, item);
+            if (fun != NULL) {
+                tehssl_object_t nn = tehssl_find_name(vm->global_scope, item->chars);
+                at = tehssl_jit_emit(at, exit, &tehssl_stencil_guard, done, nn, (const void*)fun->c_function, (const void*)tehssl_jit_check);
+                at = tehssl_jit_emit(at, exit, &tehssl_stencil_call, done + 1, NULL, NULL, (const void*)fun->c_function);
+            } else {
+                // User functions stop here and go to the interpreter unless a variable shadows them
+                at = tehssl_jit_emit(at, exit, &tehssl_stencil_operand, done, item, NULL, (const void*)tehssl_jit_variable);
+            }
+        }
+    }
+    free(items);
+    uint32_t total = n;
+    memcpy(at, tehssl_jit_epilogue, sizeof(tehssl_jit_epilogue));
+    memcpy(at + 2, &total, sizeof(total));
+    at += sizeof(tehssl_jit_epilogue);
+    mprotect(vm->jit_arena, TEHSSL_JIT_ARENA_SIZE, PROT_READ | PROT_EXEC);
+    vm->jit_used += at - start;
+    DEBUG("JIT compiled a line of %zu items into %zu bytes\n", n, (size_t)(at - start));
+    return (tehssl_jit_fun_t)start;
+}
+
+// Runs the frame's next line as compiled code, if it can be compiled.
+// Whatever the compiled code didn't finish is reversed onto frame->items for the interpreter.
+bool tehssl_jit_run(tehssl_vm_t vm, tehssl_frame_t* frame) {
+    if (vm->jit_arena == NULL) {
+        void* arena = mmap(NULL, TEHSSL_JIT_ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            vm->enable_jit = false;
+            return false;
+        }
+        vm->jit_cache = (struct tehssl_jit_entry*)calloc(TEHSSL_JIT_CACHE_SIZE, sizeof(struct tehssl_jit_entry));
+        if (vm->jit_cache == NULL) {
+            munmap(arena, TEHSSL_JIT_ARENA_SIZE);
+            vm->enable_jit = false;
+            return false;
+        }
+        vm->jit_arena = (uint8_t*)arena;
+    }
+    tehssl_object_t line = frame->code->value;
+    if (line == NULL) return false;
+    struct tehssl_jit_entry* slot = tehssl_jit_slot(vm, line);
+    if (slot->line != line) {
+        // The arena can't be made writable while compiled code further up the C stack is running
+        if (vm->jit_depth > 0) return false;
+        slot->code = tehssl_jit_compile(vm, line);
+        slot->line = line;
+    }
+    if (slot->code == NULL) return false;
+    tehssl_object_t scope = frame->scope;
+    vm->jit_depth++;
+    uint32_t done = slot->code(vm, scope);
+    vm->jit_depth--;
+    // A builtin may have run a nested evaluator and moved the return stack
+    frame = &vm->return_stack[vm->return_depth - 1];
+    IFERR(vm) return true;
+    size_t left = tehssl_list_length(line) - done;
+    tehssl_status_t status = vm->status;
+    vm->status = OK;
+    for (tehssl_object_t l = line; left > 0; l = l->next, left--) {
+        tehssl_push(vm, frame->items, l->value);
+        IFERR(vm) return true;
+    }
+    vm->status = status;
+    frame->code = frame->code->next;
+    return true;
+}
+#endif
+
 void tehssl_eval(tehssl_vm_t vm, tehssl_object_t block, tehssl_object_t scope) {
     DEBUG("Entering evaluator\n");
-    DEBUG("Doing nothing evaluator\n");
+    // The caller may have kept what was left on the stack
+    vm->temp_box = NULL;
+    size_t base = vm->return_depth;
+    tehssl_force(vm, block);
+    RIE(vm);
+    tehssl_enter(vm, block, scope, false);
+    RIE(vm);
+    while (vm->return_depth > base) {
+        yield();
+        tehssl_frame_t* frame = &vm->return_stack[vm->return_depth - 1];
+        tehssl_object_t item;
+        bool tail, word;
+        if (frame->items == NULL) {
+            if (frame->code == NULL) {
+                DEBUG("Leaving frame %zu\n", vm->return_depth);
+                vm->return_depth--;
+                continue;
+            }
+            // Between lines is a safe point to swap in new definitions
+            if (__atomic_load_n(&vm->swaps, __ATOMIC_ACQUIRE) != vm->applied) {
+                tehssl_apply_swaps(vm);
+                IFERR(vm) goto DONE;
+                frame = &vm->return_stack[vm->return_depth - 1];
+            }
+            #ifdef TEHSSL_JIT
+            if (vm->enable_jit && tehssl_jit_run(vm, frame)) {
+                frame = &vm->return_stack[vm->return_depth - 1];
+                tail = frame->items == NULL && frame->code == NULL;
+                goto STATUS;
+            }
+            #endif
+            tehssl_prepare_line(vm, frame);
+            IFERR(vm) goto DONE;
+            continue;
+        }
+        // The item stays on frame->items (and so rooted) until it has been pushed
+        item = frame->items->value;
+        tail = frame->items->next == NULL && frame->code == NULL;
+        // A word comes off frame->items first, and isn't looked at again once it has run
+        word = item != NULL && item->type == SYMBOL;
+        if (word && item->symboltype == NORMAL) frame->items = frame->items->next;
+        if (tehssl_is_literal(item)) {
+            #ifdef TEHSSL_DEBUG
+            printf("Pushing a "); if (item != NULL) debug_print_type(item->type); else printf("NULL"); putchar('\n');
+            #endif
+            tehssl_push(vm, vm->stack, item);
+        } else if (tehssl_is_block(item)) {
+            tehssl_push_closure(vm, item, frame->scope);
+        } else if (item->type == SYMBOL && item->symboltype != NORMAL) {
+            tehssl_error(vm, "keyword arguments are not supported", item->chars);
+            goto DONE;
+        } else if (item->type == SYMBOL) {
+            tehssl_object_t var = tehssl_lookup(frame->scope, item->chars, VAR);
+            tehssl_object_t fun = var == NULL ? tehssl_lookup(frame->scope, item->chars, FUN) : NULL;
+            if (var != NULL) {
+                tehssl_push(vm, vm->stack, var);
+            } else if (fun != NULL && fun->functiontype == BUILTIN) {
+                vm->calls++;
+                fun->c_function(vm, frame->scope);
+            } else if (fun != NULL) {
+                tehssl_force(vm, fun->value);
+                IFERR(vm) goto DONE;
+                tehssl_object_t new_scope = tehssl_alloc(vm, SCOPE);
+                IFERR(vm) goto DONE;
+                new_scope->parent = vm->global_scope;
+                tehssl_enter(vm, fun->value, new_scope, tail);
+            } else {
+                tehssl_error(vm, "undefined", item->chars);
+                goto DONE;
+            }
+        } else {
+            tehssl_push(vm, vm->stack, item);
+        }
+        if (!word) frame->items = frame->items->next;
+        #ifdef TEHSSL_JIT
+        STATUS:
+        #endif
+        if (vm->status == CALL) {
+            // A builtin such as Do asked for the closure on top of the stack to be run
+            vm->status = OK;
+            tehssl_object_t closure = vm->stack == NULL ? NULL : vm->stack->value;
+            if (closure == NULL || closure->type != CLOSURE) {
+                tehssl_error(vm, "not a block");
+                goto DONE;
+            }
+            // Compiled while the closure is still rooted on the stack
+            tehssl_force(vm, closure->code);
+            IFERR(vm) goto DONE;
+            tehssl_pop(vm->stack);
+            tehssl_enter(vm, closure->code, closure->scope, tail);
+        }
+        if (vm->status != OK) goto DONE;
+    }
+    DEBUG("Leaving evaluator\n");
     return;
-//     tehssl_markobject(vm, block);
-//     tehssl_markobject(vm, scope);
-//     tehssl_gc(vm);
-//     tehssl_push(vm, vm->gc_stack, block);
-//     tehssl_push(vm, vm->gc_stack, scope);
-//     while (block != NULL) {
-//         tehssl_object_t rl = tehssl_reverse_line(vm, block->code);
-//         tehssl_push(vm, vm->gc_stack, rl);
-//         RIE(vm);
-//         while (rl != NULL) {
-//             yield();
-//             tehssl_object_t item = rl->value;
-//             if (tehssl_is_literal(item)) {
-//                 #ifdef TEHSSL_DEBUG
-//                 printf("Pushing a "); if (item != NULL) debug_print_type(item->type); else printf("NULL"); putchar('\n');
-//                 #endif
-//                 tehssl_push(vm, vm->stack, item);
-//             } else {
-//                 if (item->type == BLOCK) {
-//                     tehssl_object_t closure = tehssl_alloc(vm, CLOSURE);
-//                     closure->block = item;
-//                     closure->scope = scope;
-//                     tehssl_push(vm, vm->stack, closure);
-//                 } else if (item->type == SYMBOL) {
-//                     tehssl_object_t fun = tehssl_lookup(scope, item->chars, FUN);
-//                     tehssl_object_t var = tehssl_lookup(scope, item->chars, VAR);
-//                     if (var != NULL) {
-//                         tehssl_push(vm, vm->stack, var->value);
-//                     } else if (fun != NULL) {
-//                         if (fun->type == CNFUNCTION) {
-//                             fun->c_function(vm, scope);
-//                         } else {
-//                             tehssl_object_t new_scope = tehssl_alloc(vm, SCOPE);
-//                             new_scope->parent = vm->global_scope;
-//                             tehssl_eval(vm, fun->block, new_scope);
-//                         }
-//                     } else {
-//                         tehssl_error(vm, "undefined", item->chars);
-//                         tehssl_pop(vm->gc_stack);
-//                         goto DONE;
-//                     }
-//                 }
-//             }
-//             rl = rl->next;
-//         }
-//         #ifdef TEHSSL_DEBUG
-//         printf("Done with current line\n");
-//         #endif
-//         tehssl_pop(vm->gc_stack);
-//     }
-//     DONE:
-//     #ifdef TEHSSL_DEBUG
-//     printf("Leaving evaluator");
-//     IFERR(vm) printf(" in error state");
-//     putchar('\n');
-//     #endif
-//     tehssl_pop(vm->gc_stack);
-//     tehssl_pop(vm->gc_stack);
-}
-
-void tehssl_run_string(tehssl_vm_t vm, const char* string) {
-    FILE* ss = fmemopen((void*)string, strlen(string), "r");
-    tehssl_object_t rv = tehssl_compile_until(vm, ss, EOF);
+    DONE:
+    #ifdef TEHSSL_DEBUG
+    printf("Leaving evaluator");
+    IFERR(vm) printf(" in error state");
+    putchar('\n');
+    #endif
+    vm->return_depth = base;
+}
+
+// The stream object must be rooted by the caller
+void tehssl_run_stream(tehssl_vm_t vm, tehssl_object_t stream, uint8_t options = 0) {
+    tehssl_object_t rv = tehssl_compile_until(vm, stream, EOF, options);
     RIE(vm);
     #ifdef TEHSSL_DEBUG
     if (rv == NULL) {
@@ -770,31 +2347,850 @@ void tehssl_run_string(tehssl_vm_t vm, const char* string) {
     debug_print_type(rv->type);
     putchar('\n');
     #endif
-    fclose(ss);
     tehssl_eval(vm, rv, vm->global_scope);
 }
 
+void tehssl_run_string(tehssl_vm_t vm, const char* string, uint8_t options = 0) {
+    tehssl_push(vm, vm->gc_stack, NULL);
+    RIE(vm);
+    tehssl_object_t gc_cell = vm->gc_stack;
+    gc_cell->value = tehssl_make_string_stream(vm, (char*)"string", string);
+    if (gc_cell->value != NULL) tehssl_run_stream(vm, gc_cell->value, options);
+    tehssl_pop(vm->gc_stack);
+}
+
+void tehssl_run_file(tehssl_vm_t vm, const char* path, uint8_t options = 0) {
+    tehssl_push(vm, vm->gc_stack, NULL);
+    RIE(vm);
+    tehssl_object_t gc_cell = vm->gc_stack;
+    gc_cell->value = tehssl_open_stream(vm, path);
+    if (gc_cell->value != NULL) tehssl_run_stream(vm, gc_cell->value, options);
+    else if (vm->status == OK) tehssl_error(vm, "can't open", (char*)path);
+    tehssl_pop(vm->gc_stack);
+}
+
 
 // Register C functions
 #define IS_MACRO true
 #define NOT_MACRO false
-void tehssl_register_word(tehssl_vm_t vm, const char* name, tehssl_fun_t fun) {
+// Returns the NAME for name in scope (not its parents), adding an unbound one if there isn't one.
+// The caller sets nn->binding; the NAME is already rooted through the scope when it is returned.
+tehssl_object_t tehssl_bind(tehssl_vm_t vm, tehssl_object_t scope, const char* name) {
+    tehssl_object_t found = tehssl_find_name(scope, name);
+    if (found != NULL) return found;
+    // A global name bound in any other scope may be shadowed from now on (see tehssl_jit_check()),
+    // and so may a global name added after some other scope already bound it
+    if (scope != vm->global_scope) {
+        vm->bound_locally = true;
+        found = tehssl_find_name(vm->global_scope, name);
+        if (found != NULL) tehssl_set_flag(found, SHADOWED);
+    }
+    tehssl_push(vm, scope->value, NULL);
+    RNIE(vm);
+    tehssl_object_t nn = tehssl_alloc_string(vm, NAME, name, strlen(name));
+    if (nn == NULL) {
+        tehssl_pop(scope->value);
+        return NULL;
+    }
+    if (scope == vm->global_scope && vm->bound_locally) tehssl_set_flag(nn, SHADOWED);
+    scope->value->value = nn;
+    return nn;
+}
+
+void tehssl_register_word(tehssl_vm_t vm, const char* name, tehssl_fun_t fun, bool macro = NOT_MACRO) {
     if (vm->global_scope == NULL) {
         vm->global_scope = tehssl_alloc(vm, SCOPE);
+        RIE(vm);
     }
+    tehssl_object_t nn = tehssl_bind(vm, vm->global_scope, name);
+    RIE(vm);
     tehssl_object_t fobj = tehssl_alloc(vm, FUNCTION);
-    fobj->chars = strdup(name);
-    fobj->functiontype = BUILTIN;
+    RIE(vm);
+    fobj->functiontype = macro ? BUILTIN_MACRO : BUILTIN;
     fobj->c_function = fun;
-    tehssl_push(vm, vm->global_scope, fobj);
+    tehssl_clear_flag(nn, VARIABLE);
+    nn->binding = fobj;
+}
+
+// Hot-swapping
+// tehssl_hotswap() can be called from any thread while the VM is running, and never blocks it. The new
+// body is compiled in a scratch VM on the calling thread, then published on vm->swaps with a
+// compare-and-swap. The VM's own thread picks it up at the next line boundary: the compiled objects
+// are spliced into the heap, the name is rebound to a new FUNCTION, and vm->epoch is set to its version.
+// Frames already running the old body keep going on their own lines (calls made after the swap get
+// the new one), and the old body is garbage collected once no frame refers to it.
+// Copies of the old body inlined by the optimizer are not replaced.
+
+// Returns the version of the new definition (vm->epoch is at least this once it is live),
+// or 0 if the source didn't compile.
+uint64_t tehssl_hotswap(tehssl_vm_t vm, const char* name, const char* source) {
+    tehssl_vm_t scratch = tehssl_new_vm();
+    if (scratch == NULL) return 0;
+    scratch->enable_gc = false;
+    tehssl_object_t stream = tehssl_make_string_stream(scratch, (char*)name, source);
+    tehssl_object_t block = stream == NULL ? NULL : tehssl_compile_until(scratch, stream, EOF);
+    struct tehssl_swap* swap = NULL;
+    if (scratch->status == OK && block != NULL) swap = (struct tehssl_swap*)malloc(sizeof(struct tehssl_swap));
+    if (swap == NULL) {
+        tehssl_destroy(scratch);
+        return 0;
+    }
+    swap->name = strdup(name);
+    swap->block = block;
+    swap->pages = scratch->pages;
+    swap->num_pages = scratch->num_pages;
+    swap->num_objects = scratch->num_objects;
+    swap->heap_bytes = scratch->heap_bytes;
+    scratch->pages = NULL;
+    scratch->num_pages = 0;
+    tehssl_destroy(scratch);
+    // Counted while head is in use, so the VM doesn't free it under us
+    __atomic_add_fetch(&vm->publishing, 1, __ATOMIC_SEQ_CST);
+    struct tehssl_swap* head = __atomic_load_n(&vm->swaps, __ATOMIC_SEQ_CST);
+    do {
+        swap->prev = head;
+        swap->version = head == NULL ? 1 : head->version + 1;
+    } while (!__atomic_compare_exchange_n(&vm->swaps, &head, swap, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    __atomic_sub_fetch(&vm->publishing, 1, __ATOMIC_RELEASE);
+    DEBUG("Published %s version %llu\n", name, (unsigned long long)swap->version);
+    return swap->version;
+}
+
+// Swaps in one definition; the ones published before it must already be in.
+// Everything that can fail comes before the pages are spliced in: until the block is bound, nothing
+// roots it, and a swap that is retried after running out of memory must still own its pages.
+void tehssl_apply_swap(tehssl_vm_t vm, struct tehssl_swap* swap) {
+    tehssl_object_t nn = tehssl_bind(vm, vm->global_scope, swap->name);
+    RIE(vm);
+    tehssl_object_t fobj = tehssl_alloc(vm, FUNCTION);
+    RIE(vm);
+    if (swap->pages != NULL) {
+        if (!tehssl_reserve_pages(vm, swap->num_pages)) {
+            vm->status = OUT_OF_MEMORY;
+            return;
+        }
+        // Their free slots go on the free list at the next sweep
+        memcpy(vm->pages + vm->num_pages, swap->pages, swap->num_pages * sizeof(struct tehssl_page*));
+        vm->num_pages += swap->num_pages;
+        vm->num_objects += swap->num_objects;
+        // Not checked against the quota; the code has to go somewhere
+        vm->heap_bytes += swap->heap_bytes;
+        if (vm->heap_bytes > vm->heap_peak) vm->heap_peak = vm->heap_bytes;
+        free(swap->pages);
+        swap->pages = NULL;
+        swap->num_pages = 0;
+    }
+    fobj->functiontype = USERFUNCTION;
+    fobj->value = swap->block;
+    tehssl_clear_flag(nn, VARIABLE);
+    __atomic_store_n(&nn->binding, fobj, __ATOMIC_RELEASE);
+    vm->applied = swap;
+    __atomic_store_n(&vm->epoch, swap->version, __ATOMIC_RELEASE);
+    DEBUG("Swapped in %s version %llu\n", swap->name, (unsigned long long)swap->version);
+}
+
+void tehssl_apply_swaps(tehssl_vm_t vm) {
+    if (vm->global_scope == NULL) {
+        vm->global_scope = tehssl_alloc(vm, SCOPE);
+        RIE(vm);
+    }
+    // The new blocks aren't reachable from anything until they are bound
+    bool enable_gc = vm->enable_gc;
+    vm->enable_gc = false;
+    struct tehssl_swap* head = __atomic_load_n(&vm->swaps, __ATOMIC_SEQ_CST);
+    // Publishers never follow prev, so the pending ones can be turned around in place to apply them
+    // oldest first; each link is put back as it goes by
+    struct tehssl_swap* pending = NULL;
+    for (struct tehssl_swap* swap = head; swap != vm->applied;) {
+        struct tehssl_swap* prev = swap->prev;
+        swap->prev = pending;
+        pending = swap;
+        swap = prev;
+    }
+    struct tehssl_swap* older = vm->applied;
+    while (pending != NULL) {
+        struct tehssl_swap* newer = pending->prev;
+        pending->prev = older;
+        if (vm->status == OK) tehssl_apply_swap(vm, pending);
+        older = pending;
+        pending = newer;
+    }
+    vm->enable_gc = enable_gc;
+    // Whatever came before the newest one applied is done with. A publisher that starts now can only
+    // see vm->applied or something newer, so if none is running, nothing else can get at them.
+    struct tehssl_swap* done = vm->applied == NULL ? NULL : vm->applied->prev;
+    if (done == NULL || __atomic_load_n(&vm->publishing, __ATOMIC_SEQ_CST) != 0) return;
+    vm->applied->prev = NULL;
+    while (done != NULL) {
+        struct tehssl_swap* prev = done->prev;
+        free(done->name);
+        free(done);
+        done = prev;
+    }
+}
+
+// Typed C functions
+// tehssl_register_typed(vm, "Name", fn) wraps any plain C function whose parameter and return types
+// are listed below in a BUILTIN that unboxes its arguments straight off the data stack.
+// The first parameter is the deepest argument and the last parameter is the top of the stack,
+// so `- 1 N` calls sub(N, 1). The wrapper is generated at compile time, so an unsupported
+// signature fails to compile instead of failing at run time.
+// A call allocates nothing for the arguments, except a '\0'-terminated copy of a string that is a
+// view into a stream's buffer: the result reuses the stack cell of the deepest argument. Booleans
+// are the VM's own True and False. A number result is written over a number argument that an
+// earlier typed call returned, as long as nothing can have kept a reference to it (see
+// tehssl_typed_result), so chains like `+ 1 * 2 N` allocate one box at most. Other
+// numbers and all strings get a new box.
+
+template <typename T> struct tehssl_arg { static const bool supported = false; };
+template <> struct tehssl_arg<double> {
+    static const bool supported = true;
+    static bool check(tehssl_vm_t vm, tehssl_object_t o) { (void)vm; return o != NULL && (o->type == FLOAT || o->type == INT); }
+    static double get(tehssl_object_t o) { return o->type == FLOAT ? o->float_number : (double)o->int_number; }
+};
+template <> struct tehssl_arg<int64_t> {
+    static const bool supported = true;
+    static bool check(tehssl_vm_t vm, tehssl_object_t o) { (void)vm; return o != NULL && (o->type == FLOAT || o->type == INT); }
+    static int64_t get(tehssl_object_t o) { return o->type == INT ? o->int_number : (int64_t)o->float_number; }
+};
+template <> struct tehssl_arg<bool> {
+    static const bool supported = true;
+    static bool check(tehssl_vm_t vm, tehssl_object_t o) { (void)vm; return o != NULL && o->type == SINGLETON && (o->singleton == TRUE || o->singleton == FALSE); }
+    static bool get(tehssl_object_t o) { return o->singleton == TRUE; }
+};
+template <> struct tehssl_arg<const char*> {
+    static const bool supported = true;
+    // A view isn't '\0'-terminated, so it gets a copy of its own first
+    static bool check(tehssl_vm_t vm, tehssl_object_t o) { return o != NULL && (o->type == SYMBOL || (o->type == STRING && tehssl_detach_view(vm, o))); }
+    static const char* get(tehssl_object_t o) { return o->chars; }
+};
+template <> struct tehssl_arg<tehssl_object_t> {
+    static const bool supported = true;
+    static bool check(tehssl_vm_t vm, tehssl_object_t o) { (void)vm; (void)o; return true; }
+    static tehssl_object_t get(tehssl_object_t o) { return o; }
+};
+
+// Results are allocated directly instead of going through tehssl_make_*(), which walk the whole heap
+// looking for an equal value and would make every call cost as much as the heap is big. temp is a
+// box that may be written over instead, and numbers are the only ones that do.
+template <typename T> struct tehssl_ret { static const bool supported = false; };
+template <> struct tehssl_ret<double> {
+    static const bool supported = true;
+    static const bool reusable = true;
+    static tehssl_object_t box(tehssl_vm_t vm, double x, tehssl_object_t temp) {
+        tehssl_object_t o = temp != NULL ? temp : tehssl_alloc(vm, FLOAT);
+        if (o == NULL) return NULL;
+        o->type = FLOAT;
+        o->float_number = x;
+        return o;
+    }
+};
+template <> struct tehssl_ret<int64_t> {
+    static const bool supported = true;
+    static const bool reusable = true;
+    static tehssl_object_t box(tehssl_vm_t vm, int64_t x, tehssl_object_t temp) {
+        tehssl_object_t o = temp != NULL ? temp : tehssl_alloc(vm, INT);
+        if (o == NULL) return NULL;
+        o->type = INT;
+        o->int_number = x;
+        return o;
+    }
+};
+template <> struct tehssl_ret<bool> {
+    static const bool supported = true;
+    static const bool reusable = false;
+    static tehssl_object_t box(tehssl_vm_t vm, bool x, tehssl_object_t temp) {
+        (void)temp;
+        tehssl_singleton_t s = x ? TRUE : FALSE;
+        if (vm->booleans[s] == NULL) {
+            vm->booleans[s] = tehssl_alloc(vm, SINGLETON);
+            if (vm->booleans[s] != NULL) vm->booleans[s]->singleton = s;
+        }
+        return vm->booleans[s];
+    }
+};
+template <> struct tehssl_ret<const char*> {
+    static const bool supported = true;
+    static const bool reusable = false;
+    static tehssl_object_t box(tehssl_vm_t vm, const char* x, tehssl_object_t temp) { (void)temp; return tehssl_alloc_string(vm, STRING, x, strlen(x)); }
+};
+template <> struct tehssl_ret<tehssl_object_t> {
+    static const bool supported = true;
+    static const bool reusable = false;
+    static tehssl_object_t box(tehssl_vm_t vm, tehssl_object_t x, tehssl_object_t temp) { (void)vm; (void)temp; return x; }
+};
+
+template <> struct tehssl_ret<void> { static const bool supported = true; };
+
+template <bool...> struct tehssl_all { static const bool value = true; };
+template <bool B, bool... R> struct tehssl_all<B, R...> { static const bool value = B && tehssl_all<R...>::value; };
+
+template <size_t...> struct tehssl_indices {};
+template <size_t N, size_t... I> struct tehssl_make_indices : tehssl_make_indices<N - 1, N - 1, I...> {};
+template <size_t... I> struct tehssl_make_indices<0, I...> { typedef tehssl_indices<I...> type; };
+
+// Calls the function and leaves the result in the deepest argument's cell.
+// A number box the previous typed call left on the stack can only be referred to from elsewhere if
+// some other builtin got at it in between (Twin, Let, a C function...); pushing literals and variables
+// uses new cells, and everything else the evaluator does leaves values where they are. So if no other
+// builtin was called since (vm->calls counts every one) and the box is still in the same cell, it is
+// an argument of this call and nothing else has it, and it can take the result instead of a new box.
+template <typename R> struct tehssl_typed_result {
+    template <typename F, typename... A>
+    static void run(tehssl_vm_t vm, tehssl_object_t* cells, size_t n, F fn, A... args) {
+        R result = fn(args...);
+        tehssl_object_t temp = NULL;
+        for (size_t i = 0; i < n && vm->temp_box != NULL && vm->calls == vm->temp_calls + 1; i++) {
+            if (cells[i] == vm->temp_cell && cells[i]->value == vm->temp_box) temp = vm->temp_box;
+        }
+        vm->temp_box = NULL;
+        if (n == 0) {
+            // Rooted before anything is allocated for the result
+            tehssl_push(vm, vm->stack, NULL);
+            RIE(vm);
+            cells[0] = vm->stack;
+            n = 1;
+        }
+        // Box while the arguments are still on the stack (a string result may point into one)
+        tehssl_object_t boxed = tehssl_ret<R>::box(vm, result, temp);
+        RIE(vm);
+        cells[n - 1]->value = boxed;
+        vm->stack = cells[n - 1];
+        if (tehssl_ret<R>::reusable) {
+            vm->temp_box = boxed;
+            vm->temp_cell = cells[n - 1];
+            vm->temp_calls = vm->calls;
+        }
+    }
+};
+template <> struct tehssl_typed_result<void> {
+    template <typename F, typename... A>
+    static void run(tehssl_vm_t vm, tehssl_object_t* cells, size_t n, F fn, A... args) {
+        fn(args...);
+        if (n > 0) vm->stack = cells[n - 1]->next;
+    }
+};
+
+template <typename Sig, Sig F> struct tehssl_typed;
+template <typename R, typename... A, R (*F)(A...)> struct tehssl_typed<R (*)(A...), F> {
+    static const size_t arity = sizeof...(A);
+    static_assert(tehssl_all<tehssl_arg<A>::supported...>::value, "unsupported parameter type for a typed TEHSSL function");
+    static_assert(tehssl_ret<R>::supported, "unsupported return type for a typed TEHSSL function");
+
+    template <size_t... I>
+    static void apply(tehssl_vm_t vm, tehssl_object_t* cells, tehssl_indices<I...>) {
+        bool ok[] = { true, tehssl_arg<A>::check(vm, cells[arity - 1 - I]->value)... };
+        RIE(vm);
+        for (size_t i = 0; i <= arity; i++) if (!ok[i]) ERR(vm, "wrong argument type");
+        tehssl_typed_result<R>::run(vm, cells, arity, F, tehssl_arg<A>::get(cells[arity - 1 - I]->value)...);
+    }
+
+    static void call(tehssl_vm_t vm, tehssl_object_t scope) {
+        (void)scope;
+        tehssl_object_t cells[arity + 1];
+        tehssl_object_t cell = vm->stack;
+        for (size_t i = 0; i < arity; i++) {
+            if (cell == NULL) ERR(vm, "stack underflow");
+            cells[i] = cell;
+            cell = cell->next;
+        }
+        apply(vm, cells, typename tehssl_make_indices<arity>::type());
+    }
+};
+
+#define tehssl_register_typed(vm, name, fn) tehssl_register_word((vm), (name), &tehssl_typed<decltype(&fn), &fn>::call)
+
+// Builtin functions
+double tehssl_builtin_add(double a, double b) { return a + b; }
+double tehssl_builtin_sub(double a, double b) { return a - b; }
+double tehssl_builtin_mul(double a, double b) { return a * b; }
+double tehssl_builtin_div(double a, double b) { return a / b; }
+bool tehssl_builtin_lt(double a, double b) { return a < b; }
+bool tehssl_builtin_gt(double a, double b) { return a > b; }
+bool tehssl_builtin_not(bool a) { return !a; }
+
+void tehssl_print(tehssl_object_t object) {
+    if (object == NULL) {
+        printf("Null");
+        return;
+    }
+    switch (object->type) {
+        case FLOAT: printf("%g", object->float_number); break;
+        case INT: printf("%lld", (long long)object->int_number); break;
+        case STRING: fwrite(object->chars, 1, tehssl_string_length(object), stdout); break;
+        case SYMBOL: printf("%s", object->chars); break;
+        case SINGLETON:
+            switch (object->singleton) {
+                case TRUE: printf("True"); break;
+                case FALSE: printf("False"); break;
+                case UNDEFINED: printf("Undefined"); break;
+                case DNE: printf("DNE"); break;
+            }
+            break;
+        case BLOCK:
+            printf("{");
+            for (tehssl_object_t b = object; b != NULL; b = b->next) {
+                for (tehssl_object_t l = b->value; l != NULL; l = l->next) {
+                    printf(" ");
+                    tehssl_print(l->value);
+                }
+                if (b->next != NULL) printf(";");
+            }
+            printf(" }");
+            break;
+        case LAZY: printf("{ ... }"); break;
+        default: printf("<"); debug_print_type(object->type); printf(">"); break;
+    }
+}
+
+// Def Name {Block} -- macro
+void tehssl_builtin_def(tehssl_vm_t vm, tehssl_object_t scope) {
+    tehssl_object_t rest = vm->stack->value;
+    if (tehssl_list_length(rest) < 2) ERR(vm, "Def needs a name and a block");
+    tehssl_object_t name = rest->value;
+    tehssl_object_t block = rest->next->value;
+    if (name == NULL || name->type != SYMBOL || name->symboltype != NORMAL) ERR(vm, "Def needs a name");
+    if (!tehssl_is_block(block)) ERR2(vm, "Def needs a block", name->chars);
+    tehssl_object_t nn = tehssl_bind(vm, scope, name->chars);
+    RIE(vm);
+    tehssl_object_t fobj = tehssl_alloc(vm, FUNCTION);
+    RIE(vm);
+    fobj->functiontype = USERFUNCTION;
+    fobj->value = block;
+    tehssl_clear_flag(nn, VARIABLE);
+    nn->binding = fobj;
+    vm->stack->value = rest->next->next;
+}
+
+// Let Name -- macro, binds Name to the top of the stack
+void tehssl_builtin_let(tehssl_vm_t vm, tehssl_object_t scope) {
+    tehssl_object_t rest = vm->stack->value;
+    if (rest == NULL || rest->value == NULL || rest->value->type != SYMBOL) ERR(vm, "Let needs a name");
+    if (vm->stack->next == NULL) ERR(vm, "stack underflow");
+    tehssl_object_t nn = tehssl_bind(vm, scope, rest->value->chars);
+    RIE(vm);
+    tehssl_set_flag(nn, VARIABLE);
+    nn->binding = vm->stack->next->value;
+    vm->stack->next = vm->stack->next->next;
+    vm->stack->value = rest->next;
+}
+
+// Do {Block} -- runs the block; the evaluator does the call so it can be a tail call
+void tehssl_builtin_do(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)scope;
+    if (vm->stack == NULL) ERR(vm, "stack underflow");
+    vm->status = CALL;
+}
+
+// If Condition {Then} {Else} -- leaves one of the two on the stack
+void tehssl_builtin_if(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)scope;
+    if (vm->stack == NULL || vm->stack->next == NULL || vm->stack->next->next == NULL) ERR(vm, "stack underflow");
+    tehssl_object_t cond = vm->stack->value;
+    bool truthy = cond != NULL && !(cond->type == SINGLETON && cond->singleton == FALSE);
+    tehssl_pop(vm->stack);
+    if (truthy) vm->stack->next = vm->stack->next->next;
+    else tehssl_pop(vm->stack);
+}
+
+void tehssl_builtin_twin(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)scope;
+    if (vm->stack == NULL) ERR(vm, "stack underflow");
+    tehssl_push(vm, vm->stack, vm->stack->value);
+}
+
+void tehssl_builtin_drop(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)scope;
+    if (vm->stack == NULL) ERR(vm, "stack underflow");
+    tehssl_pop(vm->stack);
+}
+
+void tehssl_builtin_noop(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)vm;
+    (void)scope;
+}
+
+void tehssl_builtin_print(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)scope;
+    if (vm->stack == NULL) ERR(vm, "stack underflow");
+    tehssl_print(vm->stack->value);
+    putchar('\n');
+    tehssl_pop(vm->stack);
+}
+
+// Open "path" -- a STREAM reading the file
+void tehssl_builtin_open(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)scope;
+    if (vm->stack == NULL) ERR(vm, "stack underflow");
+    tehssl_object_t path = vm->stack->value;
+    if (path == NULL || path->type != STRING) ERR(vm, "Open needs a string");
+    if (!tehssl_detach_view(vm, path)) return;
+    tehssl_object_t stream = tehssl_open_stream(vm, path->chars);
+    RIE(vm);
+    if (stream == NULL) ERR2(vm, "can't open", path->chars);
+    vm->stack->value = stream;
+}
+
+// Readline Stream -- the next line without its line ending, or False at the end
+void tehssl_builtin_readline(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)scope;
+    if (vm->stack == NULL) ERR(vm, "stack underflow");
+    tehssl_object_t stream = vm->stack->value;
+    if (stream == NULL || stream->type != STREAM) ERR(vm, "Readline needs a stream");
+    // The stream stays rooted in its stack cell until the line replaces it
+    tehssl_object_t line = tehssl_read_line(vm, stream);
+    if (line == NULL) line = tehssl_make_singleton(vm, FALSE);
+    RIE(vm);
+    vm->stack->value = line;
+}
+
+// Optimizer
+// Runs over a freshly compiled unit (with the GC off) when compiling with COMPILE_OPTIMIZE.
+// With COMPILE_LAZY too, each nested block is a unit of its own, optimized when tehssl_force() compiles
+// it, however deep it is nested (the OPTIMIZE flag is passed down to the LAZY blocks inside it).
+// Words are resolved against the global scope as it is at compile time, so only builtins that
+// are already registered are folded away.
+//  * Noop is dropped.
+//  * A PURE builtin followed by literals is run at compile time: `+ 1 * 2 3` becomes `7`.
+//  * `If True A B` becomes `A` (and `If False A B` becomes `B`).
+//  * Consecutive lines that only push literals are merged into one line.
+//  * A word defined once in the unit with `Def Name {...}`, whose body is one short line of
+//    literals and builtins, is replaced by a copy of that line after the Def.
+// None of these touch the name after a Def or Let, or a word the unit binds with Def or Let itself,
+// in a LAZY block inside it, or around it (see tehssl_compile_until()).
+// Informal lowercase words never get this far; the tokenizer already drops them.
+
+struct tehssl_inline {
+    const char* name;
+    tehssl_object_t body;       // the single LINE, or NULL if the body can't be inlined
+    tehssl_object_t defined_at; // the top-level line with the Def
+    int defs;
+    bool shadowed;
+    bool active;
+};
+
+struct tehssl_optimizer {
+    tehssl_vm_t vm;
+    struct tehssl_inline* defs;
+    size_t num_defs;
+};
+
+bool tehssl_is_builtin(tehssl_vm_t vm, tehssl_object_t item, tehssl_fun_t fn) {
+    tehssl_object_t fun = tehssl_global_builtin(vm, item);
+    if (fun != NULL) return fun->c_function == fn;
+    if (item == NULL || item->type != SYMBOL || item->symboltype != NORMAL) return false;
+    fun = tehssl_lookup(vm->global_scope, item->chars, MACRO);
+    return fun != NULL && fun->functiontype == BUILTIN_MACRO && fun->c_function == fn;
+}
+
+struct tehssl_inline* tehssl_find_def(struct tehssl_optimizer* opt, const char* name) {
+    for (size_t i = 0; i < opt->num_defs; i++) {
+        if (strcmp(opt->defs[i].name, name) == 0) return &opt->defs[i];
+    }
+    return NULL;
+}
+
+struct tehssl_inline* tehssl_add_def(struct tehssl_optimizer* opt, const char* name) {
+    struct tehssl_inline* def = tehssl_find_def(opt, name);
+    if (def != NULL) return def;
+    struct tehssl_inline* defs = (struct tehssl_inline*)realloc(opt->defs, (opt->num_defs + 1) * sizeof(struct tehssl_inline));
+    if (defs == NULL) return NULL;
+    opt->defs = defs;
+    def = &opt->defs[opt->num_defs++];
+    def->name = name;
+    def->body = NULL;
+    def->defined_at = NULL;
+    def->defs = 0;
+    def->shadowed = false;
+    def->active = false;
+    return def;
+}
+
+// Only a single short line of literals and (non-macro) builtins can be inlined. A word the unit
+// binds itself is out too: the body would see the caller's binding instead of the global builtin.
+bool tehssl_can_inline(struct tehssl_optimizer* opt, tehssl_object_t body) {
+    if (body == NULL || body->next != NULL || body->value == NULL) return false;
+    int n = 0;
+    for (tehssl_object_t l = body->value; l != NULL; l = l->next, n++) {
+        if (n >= TEHSSL_INLINE_SIZE) return false;
+        if (tehssl_is_literal(l->value)) continue;
+        tehssl_object_t fun = tehssl_global_builtin(opt->vm, l->value);
+        if (fun == NULL || fun->c_function == tehssl_builtin_do) return false;
+        if (tehssl_find_def(opt, l->value->chars) != NULL) return false;
+    }
+    return true;
+}
+
+// Finds every Def and Let in the unit; only top-level Defs are inlining candidates
+void tehssl_collect_defs(struct tehssl_optimizer* opt, tehssl_object_t block, bool top) {
+    for (; block != NULL; block = block->next) {
+        for (tehssl_object_t l = block->value; l != NULL; l = l->next) {
+            tehssl_object_t item = l->value;
+            if (item != NULL && item->type == BLOCK) tehssl_collect_defs(opt, item, false);
+            if (l->next == NULL || l->next->value == NULL || l->next->value->type != SYMBOL) continue;
+            bool def = tehssl_is_builtin(opt->vm, item, tehssl_builtin_def);
+            if (!def && !tehssl_is_builtin(opt->vm, item, tehssl_builtin_let)) continue;
+            struct tehssl_inline* entry = tehssl_add_def(opt, l->next->value->chars);
+            if (entry == NULL) continue;
+            if (!def) {
+                entry->shadowed = true;
+                continue;
+            }
+            entry->defs++;
+            if (top && l->next->next != NULL && l->next->next->value != NULL && l->next->next->value->type == BLOCK) {
+                entry->body = l->next->next->value;
+                entry->defined_at = block;
+            }
+        }
+    }
+}
+
+// Runs the PURE builtin at `at` on the literals to its right; returns true if it folded
+bool tehssl_fold(tehssl_vm_t vm, tehssl_object_t at) {
+    tehssl_object_t fun = tehssl_global_builtin(vm, at->value);
+    if (fun == NULL || !tehssl_test_flag(fun, PURE)) return false;
+    tehssl_object_t operands[TEHSSL_INLINE_SIZE];
+    size_t n = 0;
+    for (tehssl_object_t l = at->next; l != NULL && n < TEHSSL_INLINE_SIZE && tehssl_is_literal(l->value); l = l->next) operands[n++] = l;
+    if (n == 0) return false;
+    tehssl_object_t old_stack = vm->stack;
+    tehssl_object_t old_return_value = vm->return_value;
+    vm->stack = NULL;
+    // The nearest operand ends up on top, just like at run time
+    for (size_t i = n; i > 0; i--) tehssl_push(vm, vm->stack, operands[i - 1]->value);
+    tehssl_object_t cells[TEHSSL_INLINE_SIZE + 1];
+    tehssl_object_t cell = vm->stack;
+    for (size_t i = 0; i <= n; i++) {
+        cells[i] = cell;
+        if (cell != NULL) cell = cell->next;
+    }
+    if (vm->status == OK) fun->c_function(vm, vm->global_scope);
+    // The result is about to become part of the code
+    vm->temp_box = NULL;
+    bool folded = false;
+    if (vm->status == OK && vm->stack != NULL && tehssl_is_literal(vm->stack->value)) {
+        for (size_t k = 0; k <= n; k++) {
+            if (vm->stack->next != cells[k]) continue;
+            DEBUG("Folded %s over %zu operands\n", at->value->chars, k);
+            at->value = vm->stack->value;
+            at->next = k == 0 ? at->next : operands[k - 1]->next;
+            folded = true;
+            break;
+        }
+    }
+    // Failing to fold is not an error; it will fail again at run time if it's really wrong
+    vm->status = OK;
+    vm->stack = old_stack;
+    vm->return_value = old_return_value;
+    return folded;
+}
+
+// A word the unit binds itself with Def or Let may not be the builtin by the time it runs, and the
+// word right after a Def or Let is the name being bound, not a call; neither is touched
+bool tehssl_keep_word(struct tehssl_optimizer* opt, tehssl_object_t item, tehssl_object_t prev) {
+    if (item != NULL && item->type == SYMBOL && tehssl_find_def(opt, item->chars) != NULL) return true;
+    return tehssl_is_builtin(opt->vm, prev, tehssl_builtin_def) || tehssl_is_builtin(opt->vm, prev, tehssl_builtin_let);
+}
+
+// Folds right to left, so `+ 1 * 2 3` folds the * before the +
+bool tehssl_fold_line(struct tehssl_optimizer* opt, tehssl_object_t line, tehssl_object_t prev) {
+    if (line == NULL) return false;
+    bool changed = tehssl_fold_line(opt, line->next, line->value);
+    if (tehssl_keep_word(opt, line->value, prev)) return changed;
+    return tehssl_fold(opt->vm, line) || changed;
+}
+
+void tehssl_optimize_block(struct tehssl_optimizer* opt, tehssl_object_t block, bool top);
+
+void tehssl_optimize_line(struct tehssl_optimizer* opt, tehssl_object_t* line) {
+    tehssl_vm_t vm = opt->vm;
+    // Inline first so the copied bodies get folded along with the rest of the line
+    for (tehssl_object_t* l = line; *l != NULL;) {
+        tehssl_object_t item = (*l)->value;
+        if (item != NULL && item->type == BLOCK) tehssl_optimize_block(opt, item, false);
+        struct tehssl_inline* def = item != NULL && item->type == SYMBOL && item->symboltype == NORMAL ? tehssl_find_def(opt, item->chars) : NULL;
+        if (def != NULL && def->active && def->defs == 1 && !def->shadowed && tehssl_can_inline(opt, def->body)) {
+            DEBUG("Inlining %s\n", item->chars);
+            tehssl_object_t rest = (*l)->next;
+            for (tehssl_object_t b = def->body->value; b != NULL; b = b->next) {
+                *l = tehssl_alloc(vm, LINE);
+                if (vm->status != OK) return;
+                (*l)->value = b->value;
+                l = &(*l)->next;
+            }
+            *l = rest;
+            continue;
+        }
+        l = &(*l)->next;
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        tehssl_object_t prev = NULL;
+        for (tehssl_object_t* l = line; *l != NULL;) {
+            tehssl_object_t item = (*l)->value;
+            if (tehssl_keep_word(opt, item, prev)) {
+                prev = item;
+                l = &(*l)->next;
+                continue;
+            }
+            if (tehssl_is_builtin(vm, item, tehssl_builtin_noop)) {
+                *l = (*l)->next;
+                changed = true;
+                continue;
+            }
+            tehssl_object_t c = (*l)->next;
+            if (tehssl_is_builtin(vm, item, tehssl_builtin_if) && c != NULL && tehssl_is_literal(c->value) && c->next != NULL && c->next->next != NULL) {
+                tehssl_object_t a = c->next;
+                tehssl_object_t b = a->next;
+                if ((tehssl_is_literal(a->value) || tehssl_is_block(a->value)) && (tehssl_is_literal(b->value) || tehssl_is_block(b->value))) {
+                    bool truthy = c->value != NULL && !(c->value->type == SINGLETON && c->value->singleton == FALSE);
+                    DEBUG("Resolved If at compile time\n");
+                    tehssl_object_t chosen = truthy ? a : b;
+                    chosen->next = b->next;
+                    *l = chosen;
+                    changed = true;
+                    continue;
+                }
+            }
+            prev = item;
+            l = &(*l)->next;
+        }
+        if (tehssl_fold_line(opt, *line, NULL)) changed = true;
+    }
+}
+
+bool tehssl_pushes_only(tehssl_object_t line) {
+    for (; line != NULL; line = line->next) {
+        if (!tehssl_is_literal(line->value) && !tehssl_is_block(line->value)) return false;
+    }
+    return true;
+}
+
+void tehssl_optimize_block(struct tehssl_optimizer* opt, tehssl_object_t block, bool top) {
+    for (tehssl_object_t b = block; b != NULL; b = b->next) {
+        tehssl_optimize_line(opt, &b->value);
+        if (opt->vm->status != OK) return;
+        if (top) {
+            for (size_t i = 0; i < opt->num_defs; i++) {
+                if (opt->defs[i].defined_at == b) opt->defs[i].active = true;
+            }
+        }
+    }
+    // Drop lines that optimized away and merge runs of lines that only push.
+    // `A; B` runs A then B, and so does the single line `B A` (lines run right to left).
+    tehssl_object_t* b = &block->next;
+    tehssl_object_t prev = block;
+    while (*b != NULL) {
+        if ((*b)->value == NULL) {
+            *b = (*b)->next;
+            continue;
+        }
+        if (prev->value != NULL && tehssl_pushes_only(prev->value) && tehssl_pushes_only((*b)->value)) {
+            tehssl_object_t tail = (*b)->value;
+            while (tail->next != NULL) tail = tail->next;
+            tail->next = prev->value;
+            prev->value = (*b)->value;
+            *b = (*b)->next;
+            continue;
+        }
+        prev = *b;
+        b = &(*b)->next;
+    }
+}
+
+// names is a list of SYMBOLs bound outside the unit, or in LAZY blocks inside it
+void tehssl_optimize(tehssl_vm_t vm, tehssl_object_t block, tehssl_object_t names) {
+    if (vm->global_scope == NULL) return;
+    struct tehssl_optimizer opt;
+    opt.vm = vm;
+    opt.defs = NULL;
+    opt.num_defs = 0;
+    for (; names != NULL; names = names->next) {
+        struct tehssl_inline* entry = tehssl_add_def(&opt, names->value->chars);
+        if (entry == NULL) {
+            // Not optimizing at all is always safe
+            free(opt.defs);
+            return;
+        }
+        entry->shadowed = true;
+    }
+    tehssl_collect_defs(&opt, block, true);
+    tehssl_optimize_block(&opt, block, true);
+    free(opt.defs);
+}
+
+// Optimizes a unit with the GC off. With COMPILE_LAZY the unit has a CONS (see tehssl_compile_until())
+// whose list of names already has what is bound around it and in its LAZY blocks; the words it binds
+// itself are added once it is optimized, for the LAZY blocks in it. The block and unit must be rooted.
+void tehssl_optimize_unit(tehssl_vm_t vm, tehssl_object_t block, tehssl_object_t unit) {
+    bool oldenable = vm->enable_gc;
+    vm->enable_gc = false;
+    tehssl_optimize(vm, block, unit != NULL ? unit->cdr : NULL);
+    vm->enable_gc = oldenable;
+    if (unit == NULL) return;
+    for (tehssl_object_t b = block; b != NULL; b = b->next) {
+        for (tehssl_object_t l = b->value; l != NULL; l = l->next) {
+            if (l->next == NULL || l->next->value == NULL || l->next->value->type != SYMBOL) continue;
+            if (!tehssl_is_builtin(vm, l->value, tehssl_builtin_def) && !tehssl_is_builtin(vm, l->value, tehssl_builtin_let)) continue;
+            tehssl_push(vm, unit->cdr, l->next->value);
+            RIE(vm);
+        }
+    }
 }
 
 void tehssl_init_builtins(tehssl_vm_t vm) {
+    tehssl_register_typed(vm, "+", tehssl_builtin_add);
+    tehssl_register_typed(vm, "-", tehssl_builtin_sub);
+    tehssl_register_typed(vm, "*", tehssl_builtin_mul);
+    tehssl_register_typed(vm, "/", tehssl_builtin_div);
+    tehssl_register_typed(vm, "<", tehssl_builtin_lt);
+    tehssl_register_typed(vm, ">", tehssl_builtin_gt);
+    tehssl_register_typed(vm, "Not", tehssl_builtin_not);
+    tehssl_register_word(vm, "Def", tehssl_builtin_def, IS_MACRO);
+    tehssl_register_word(vm, "Let", tehssl_builtin_let, IS_MACRO);
+    tehssl_register_word(vm, "Do", tehssl_builtin_do);
+    tehssl_register_word(vm, "If", tehssl_builtin_if);
+    tehssl_register_word(vm, "Twin", tehssl_builtin_twin);
+    tehssl_register_word(vm, "Drop", tehssl_builtin_drop);
+    tehssl_register_word(vm, "Print", tehssl_builtin_print);
+    tehssl_register_word(vm, "Noop", tehssl_builtin_noop);
+    tehssl_register_word(vm, "Open", tehssl_builtin_open);
+    tehssl_register_word(vm, "Readline", tehssl_builtin_readline);
+    const char* pure[] = { "+", "-", "*", "/", "<", ">", "Not" };
+    for (size_t i = 0; i < sizeof(pure) / sizeof(pure[0]); i++) {
+        tehssl_set_flag(tehssl_lookup(vm->global_scope, (char*)pure[i], FUN), PURE);
+    }
     // TODO add all builtins
 }
 
 #ifdef TEHSSL_TEST
+#include <pthread.h>
 void myfunction(tehssl_vm_t vm, tehssl_object_t scope) { printf("myfunction called!\n"); }
+int64_t mylength(const char* s) { return strlen(s); }
+double myzero() { return 42.5; }
+void myswap(tehssl_vm_t vm, tehssl_object_t scope) {
+    (void)scope;
+    tehssl_hotswap(vm, "Slow", "Print \"new body\"");
+}
+void* mypublisher(void* vm) {
+    for (int i = 0; i < 100; i++) tehssl_hotswap((tehssl_vm_t)vm, "Tick", i % 2 ? "1" : "2");
+    tehssl_hotswap((tehssl_vm_t)vm, "Tick", "\"last\"");
+    return NULL;
+}
+// A binary tree of CONS cells with a FLOAT and a STRING at each leaf; the GC must be off
+tehssl_object_t mytree(tehssl_vm_t vm, int depth) {
+    tehssl_object_t node = tehssl_alloc(vm, CONS);
+    if (depth == 0) {
+        node->car = tehssl_alloc(vm, FLOAT);
+        node->car->float_number = depth;
+        node->cdr = tehssl_alloc_string(vm, STRING, "leaf", 4);
+        return node;
+    }
+    node->car = mytree(vm, depth - 1);
+    node->cdr = mytree(vm, depth - 1);
+    return node;
+}
 int main(int argc, char* argv[]) {
     const char* str = "~~Hello world!; Foobar\nFor each number in Range 1 to 0x0A -step 3 do { take the Square; Print the Fibonacci of said square; };\n~~Literals\nPrints {\"DONE!!\" 123 123.456E789 Infinity NaN Undefined DNE False True}";
     tehssl_vm_t vm = tehssl_new_vm();
@@ -806,9 +3202,11 @@ int main(int argc, char* argv[]) {
         tehssl_make_float(vm, 456.789123);
         tehssl_make_string(vm, "i am cow hear me moo");
         tehssl_make_symbol(vm, "Symbol!", LITERAL);
-        // This is not garbage, it is on the stack now
-        tehssl_push(vm, vm->stack, tehssl_make_float(vm, 1.7E+123));
-        tehssl_push(vm, vm->stack, tehssl_make_string(vm, "Foo123"));
+        // This is not garbage, it is on the stack now (the cell goes on first, so it is rooted)
+        tehssl_push(vm, vm->stack, NULL);
+        vm->stack->value = tehssl_make_float(vm, 1.7E+123);
+        tehssl_push(vm, vm->stack, NULL);
+        vm->stack->value = tehssl_make_string(vm, "Foo123");
     }
     tehssl_register_word(vm, "MyFunction", myfunction);
     printf("%u objects\n", vm->num_objects);
@@ -816,10 +3214,11 @@ int main(int argc, char* argv[]) {
     printf("%u objects after gc\n", vm->num_objects);
 
     printf("\n\n-----test 2: tokenizer----\n\n");
-    FILE* s = fmemopen((void*)str, strlen(str), "r");
+    tehssl_push(vm, vm->gc_stack, NULL);
+    tehssl_object_t s = vm->gc_stack->value = tehssl_make_string_stream(vm, (char*)"string", str);
     char* token = NULL;
-    while (!feof(s)) {
-        token = tehssl_next_token(s);
+    while (!tehssl_stream_eof(s)) {
+        token = tehssl_next_token(vm, s);
         if (token == NULL) {
             printf("\n\nTOKENIZER ERROR!!");
             break;
@@ -833,27 +3232,342 @@ int main(int argc, char* argv[]) {
         if (token[0] == '"') putchar('"');
         free(token);
     }
-    fclose(s);
     putchar('\n');
 
     printf("\n\n-----test 3: compiler----\n\n");
     printf("making stringstream...\n");
-    s = fmemopen((void*)str, strlen(str), "r");
+    s = vm->gc_stack->value = tehssl_make_string_stream(vm, (char*)"string", str);
     tehssl_object_t c = tehssl_compile_until(vm, s, EOF);
     printf("Returned %d: ", vm->status);
     if (c == NULL) printf("Compile returned NULL!!");
     else debug_print_type(c->type);
-    fclose(s);
+    tehssl_pop(vm->gc_stack);
     printf("\ncollecting garbage\n");
     tehssl_gc(vm);
 
     printf("\n\n-----test 4: freeing a fmemopen()'ed stream----\n\n");
-    s = fmemopen((void*)str, strlen(str), "r");
-    tehssl_make_stream(vm, "stringstream", s);
+    tehssl_make_stream(vm, "stringstream", fmemopen((void*)str, strlen(str), "r"));
     tehssl_gc(vm);
 
     printf("\n\n-----test 5: evaluator----\n\n");
     tehssl_run_string(vm, str);
+    printf("Returned %d", vm->status);
+    if (vm->status == ERROR) printf(": %s", vm->return_value->chars);
+    putchar('\n');
+
+    printf("\n\n-----test 6: typed C functions----\n\n");
+    vm->status = OK;
+    vm->stack = NULL;
+    tehssl_init_builtins(vm);
+    tehssl_register_typed(vm, "Length", mylength);
+    tehssl_register_typed(vm, "Zero", myzero);
+    // Push the cell before boxing so the box is rooted if allocating it triggers a GC
+    tehssl_push(vm, vm->stack, NULL);
+    vm->stack->value = tehssl_make_float(vm, 10);
+    tehssl_push(vm, vm->stack, NULL);
+    vm->stack->value = tehssl_make_float(vm, 4);
+    tehssl_object_t cell = vm->stack->next;
+    tehssl_lookup(vm->global_scope, (char*)"-", FUN)->c_function(vm, vm->global_scope);
+    printf("- 4 10 => %g, reused cell: %s, depth %d\n", vm->stack->value->float_number, vm->stack == cell ? "yes" : "no", tehssl_list_length(vm->stack));
+    tehssl_push(vm, vm->stack, NULL);
+    vm->stack->value = tehssl_make_string(vm, (char*)"hello");
+    tehssl_lookup(vm->global_scope, (char*)"Length", FUN)->c_function(vm, vm->global_scope);
+    printf("Length \"hello\" => %lld\n", (long long)vm->stack->value->int_number);
+    tehssl_lookup(vm->global_scope, (char*)"Not", FUN)->c_function(vm, vm->global_scope);
+    printf("Not 5 => status %d (%s)\n", vm->status, vm->return_value->chars);
+    vm->status = OK;
+    vm->stack = NULL;
+    tehssl_lookup(vm->global_scope, (char*)"+", FUN)->c_function(vm, vm->global_scope);
+    printf("+ on empty stack => status %d (%s)\n", vm->status, vm->return_value->chars);
+    vm->status = OK;
+    tehssl_run_string(vm, "Print Zero; Print + Twin * 2 3; Print < 1 2; Print Not True");
+    printf("status %d\n", vm->status);
+    tehssl_push(vm, vm->gc_stack, NULL);
+    s = vm->gc_stack->value = tehssl_make_string_stream(vm, (char*)"string", "+ 1 * 2 + 3 4");
+    c = vm->gc_stack->value = tehssl_compile_until(vm, s, EOF);
+    vm->stack = NULL;
+    vm->enable_gc = false;
+    size_t before = vm->num_objects;
+    tehssl_eval(vm, c, vm->global_scope);
+    // All three results go into one box; the rest are cells for the line and the literals (two more without reuse)
+    printf("+ 1 * 2 + 3 4 => %g, %zu objects allocated\n", vm->stack->value->float_number, vm->num_objects - before);
+    vm->enable_gc = true;
+    tehssl_pop(vm->gc_stack);
+    vm->stack = NULL;
+
+    printf("\n\n-----test 7: tail calls----\n\n");
+    tehssl_run_string(vm, "Def Fact { Let N; Let Acc; Do If < 1 N { Acc } { Fact - 1 N * N Acc } }; Print Fact 10 1");
+    tehssl_run_string(vm, "Def Fib { Let N; Do If < 2 N { N } { + Fib - 1 N Fib - 2 N } }; Print Fib 15");
+    tehssl_run_string(vm, "Def Countdown { Let N; Do If < 1 N { N } { Countdown - 1 N } }; Print Countdown 100000");
+    printf("status %d, return stack capacity %zu, %zu objects\n", vm->status, vm->return_capacity, vm->num_objects);
+    tehssl_run_string(vm, "Def Deep { + 1 Deep }; Deep");
+    printf("non-tail recursion => status %d (%s), depth %zu\n", vm->status, vm->return_value->chars, vm->return_depth);
+    vm->status = OK;
+
+    printf("\n\n-----test 8: optimizer----\n\n");
+    const char* prog = "Def Square { * Twin }; Def Fact { Let N; Let Acc; Do If < 1 N { Acc } { Fact - 1 N * N Acc } }; "
+        "Noop; Print + 1 * 2 3; 1; 2; Drop; Drop; Print Square - 7 Square 3; Print Do If > 1 2 { \"yes\" } { \"no\" }; Print Fact 5 1";
+    for (uint8_t options = 0; options <= COMPILE_OPTIMIZE; options++) {
+        tehssl_push(vm, vm->gc_stack, NULL);
+        s = vm->gc_stack->value = tehssl_make_string_stream(vm, (char*)"string", prog);
+        c = tehssl_compile_until(vm, s, EOF, options);
+        tehssl_pop(vm->gc_stack);
+        printf("%s: ", options ? "Optimized" : "Unoptimized");
+        tehssl_print(c);
+        putchar('\n');
+        tehssl_eval(vm, c, vm->global_scope);
+        printf("status %d\n", vm->status);
+    }
+    tehssl_vm_t ovm = tehssl_new_vm();
+    tehssl_init_builtins(ovm);
+    for (uint8_t options = 0; options <= COMPILE_OPTIMIZE; options++) {
+        tehssl_run_string(ovm, "Def Noop { Print \"redefined Noop\" }; Noop; \"rebound If\"; Let If; Print If; 10; Let +; Print + 1 2", options);
+        printf("%s, builtin names rebound => status %d\n", options ? "Optimized" : "Unoptimized", ovm->status);
+    }
+    tehssl_destroy(ovm);
+    for (uint8_t options = 0; options <= COMPILE_OPTIMIZE; options++) {
+        ovm = tehssl_new_vm();
+        tehssl_init_builtins(ovm);
+        tehssl_run_string(ovm, "Def Inc { + 1 }; Def F { 100; Let +; Print Inc 5 }; F", options);
+        printf("%s, body using a word the caller binds => status %d\n", options ? "Optimized" : "Unoptimized", ovm->status);
+        tehssl_destroy(ovm);
+    }
+
+    printf("\n\n-----test 9: JIT----\n\n");
+    const char* jitprog = "Def Fib { Let N; Do If < 2 N { N } { + Fib - 1 N Fib - 2 N } }; Print Fib 20; "
+        "Def Loop { Let N; Do If < 1 N { N } { Loop - 1 N } }; Print Loop 50000; "
+        "Print * 2 + 3 4; Print Do If Not < 1 2 { \"then\" } { \"else\" }; "
+        "Def Shadow { Let Not; Print Not }; Shadow \"shadowed Not\"; Print Not True; Print Undefined-word";
+    for (int jit = 0; jit <= 1; jit++) {
+        vm->enable_jit = jit;
+        printf("JIT %s:\n", jit ? "on" : "off");
+        tehssl_run_string(vm, jitprog);
+        printf("status %d", vm->status);
+        if (vm->status == ERROR) printf(" (%s)", vm->return_value->chars);
+        putchar('\n');
+        vm->status = OK;
+        vm->stack = NULL;
+    }
+    #ifdef TEHSSL_JIT
+    printf("JIT arena used: %s\n", vm->jit_used > 0 ? "yes" : "no");
+    #endif
+    vm->enable_jit = false;
+
+    printf("\n\n-----test 10: streams----\n\n");
+    char path[] = "/tmp/tehsslXXXXXX";
+    int fd = mkstemp(path);
+    FILE* f = fdopen(fd, "w");
+    fputs("alpha\nbeta\r\ngamma", f);
+    fclose(f);
+    char script[256];
+    snprintf(script, sizeof(script), "Def Each { Let N; Let F; Let L; Do If L { Print L; Lines F + 1 N } { N } }; "
+        "Def Lines { Let F; Let N; Each N F Readline F }; Print Lines Open \"%s\" 0", path);
+    tehssl_run_string(vm, script);
+    printf("status %d", vm->status);
+    if (vm->status == ERROR) printf(" (%s)", vm->return_value->chars);
+    putchar('\n');
+    vm->status = OK;
+    vm->stack = NULL;
+    tehssl_push(vm, vm->gc_stack, NULL);
+    for (int buffered = 0; buffered <= 1; buffered++) {
+        s = vm->gc_stack->value = buffered ? tehssl_make_stream(vm, (char*)"file", fopen(path, "r")) : tehssl_open_stream(vm, path);
+        printf("%s:", buffered ? "Buffered" : "Resident");
+        tehssl_object_t line;
+        while ((line = tehssl_read_line(vm, s)) != NULL) printf(" [%.*s]%s", (int)tehssl_string_length(line), line->chars, tehssl_test_flag(line, VIEW) ? "" : " (copy)");
+        putchar('\n');
+    }
+    tehssl_gc(vm);
+    f = fopen(path, "w");
+    for (int i = 0; i < 20000; i++) fprintf(f, "line %d of a file that takes a few refills to read\n", i);
+    fclose(f);
+    s = vm->gc_stack->value = tehssl_make_stream(vm, (char*)"file", fopen(path, "r"));
+    size_t lines = 0, refills = 0, reused = 0;
+    while (true) {
+        tehssl_object_t buffer = s->stream->buffer;
+        tehssl_object_t spare = s->stream->spare_free ? s->stream->spare : NULL;
+        if (tehssl_read_line(vm, s) == NULL) break;
+        if (s->stream->buffer != buffer) {
+            refills++;
+            if (s->stream->buffer == spare) reused++;
+        }
+        if (++lines % 500 == 0) tehssl_gc(vm);
+    }
+    printf("Buffered, %zu lines: %zu refills, %zu of them into a buffer the GC gave back\n", lines, refills, reused);
+    tehssl_pop(vm->gc_stack);
+    tehssl_gc(vm);
+    snprintf(script, sizeof(script), "Open \"%s\"", path);
+    tehssl_run_string(vm, script);
+    printf("Open => %s stream\n", vm->stack != NULL && vm->stack->value->stream->file == NULL ? "mapped" : "buffered");
+    vm->stack = NULL;
+    // A typed function gets a '\0'-terminated copy of the view
+    snprintf(script, sizeof(script), "Print Length Readline Open \"%s\"", path);
+    tehssl_run_string(vm, script);
+    vm->stack = NULL;
+    remove(path);
+    tehssl_run_string(vm, "Open \"/nonexistent/file\"");
+    printf("Open missing file => status %d (%s)\n", vm->status, vm->return_value->chars);
+    vm->status = OK;
+    vm->stack = NULL;
+
+    printf("\n\n-----test 11: hot-swapping----\n\n");
+    tehssl_register_word(vm, "Swap-slow", myswap);
+    tehssl_run_string(vm, "Def Version { 1 }; Def Slow { Print \"old body, before\"; Swap-slow; Print \"old body, after\" }");
+    tehssl_object_t old_body = tehssl_lookup(vm->global_scope, (char*)"Slow", FUN)->value;
+    printf("Published version %llu, epoch %llu\n", (unsigned long long)tehssl_hotswap(vm, "Version", "2"), (unsigned long long)vm->epoch);
+    printf("Bad source => version %llu\n", (unsigned long long)tehssl_hotswap(vm, "Version", "{ 3"));
+    tehssl_run_string(vm, "Print Version; Slow; Slow");
+    tehssl_gc(vm);
+    bool reclaimed = true;
+    tehssl_each_object(vm, o) if (o == old_body) reclaimed = false;
+    printf("status %d, epoch %llu, old body reclaimed: %s\n", vm->status, (unsigned long long)vm->epoch, reclaimed ? "yes" : "no");
+    tehssl_run_string(vm, "Def Tick { 0 }; Def Ticks { Let N; Let Acc; Do If < 1 N { Acc } { Ticks - 1 N Tick } }");
+    pthread_t publisher;
+    pthread_create(&publisher, NULL, mypublisher, vm);
+    tehssl_run_string(vm, "Drop Ticks 20000 0");
+    pthread_join(publisher, NULL);
+    tehssl_run_string(vm, "Print Tick");
+    printf("status %d, epoch %llu\n", vm->status, (unsigned long long)vm->epoch);
+    // Far more than would fit on the C stack if they were applied recursively
+    for (int i = 0; i < 100000; i++) tehssl_hotswap(vm, "Tick", "1");
+    tehssl_run_string(vm, "Print Tick");
+    size_t kept = 0;
+    for (struct tehssl_swap* swap = vm->swaps; swap != NULL; swap = swap->prev) kept++;
+    printf("status %d, epoch %llu, definitions kept: %zu\n", vm->status, (unsigned long long)vm->epoch, kept);
+    // Running out of memory while swapping in must leave the definition to be swapped in later
+    tehssl_vm_t qvm = tehssl_new_vm();
+    tehssl_init_builtins(qvm);
+    char body[16384] = "Print \"swapped in after running out of memory\"; Drop";
+    for (int i = 0; i < 800; i++) snprintf(body + strlen(body), sizeof(body) - strlen(body), " \"string %d\"", i);
+    tehssl_gc(qvm);
+    qvm->heap_limit = qvm->heap_bytes + 2000;
+    tehssl_hotswap(qvm, "G", body);
+    tehssl_run_string(qvm, "Noop");
+    printf("Over quota => status %d, epoch %llu\n", qvm->status, (unsigned long long)qvm->epoch);
+    qvm->status = OK;
+    qvm->stack = NULL;
+    qvm->heap_limit = 0;
+    tehssl_gc(qvm);
+    tehssl_run_string(qvm, "G");
+    printf("status %d, epoch %llu\n", qvm->status, (unsigned long long)qvm->epoch);
+    tehssl_destroy(qvm);
+
+    printf("\n\n-----test 12: lazy compilation----\n\n");
+    const char* library = "Def Square { * Twin }; Def Cube { Let N; * N Square N }; "
+        "Def Unused { Print \"never\"; { nested { blocks } } }; Def Broken { Print \"}\" }; Print Cube 3; Print Do { + 1 2 }";
+    for (uint8_t options = 0; options <= COMPILE_LAZY; options += COMPILE_LAZY) {
+        tehssl_push(vm, vm->gc_stack, NULL);
+        s = vm->gc_stack->value = tehssl_make_string_stream(vm, (char*)"string", library);
+        c = tehssl_compile_until(vm, s, EOF, options);
+        tehssl_pop(vm->gc_stack);
+        printf("%s: ", options ? "Lazy" : "Eager");
+        tehssl_print(c);
+        putchar('\n');
+        tehssl_run_string(vm, library, options);
+        printf("status %d, Cube is now ", vm->status);
+        tehssl_print(tehssl_lookup(vm->global_scope, (char*)"Cube", FUN)->value);
+        printf(", Unused is ");
+        tehssl_print(tehssl_lookup(vm->global_scope, (char*)"Unused", FUN)->value);
+        putchar('\n');
+    }
+    tehssl_run_string(vm, "Def Lopsided { Print 1; { Print 2 }", COMPILE_LAZY);
+    printf("Unbalanced => status %d (%s)\n", vm->status, vm->return_value->chars);
+    vm->status = OK;
+    tehssl_run_string(vm, "Def Fib { Let N; Do If < 2 N { N } { + Fib - 1 N Fib - 2 N } }; Print Fib 15", COMPILE_LAZY | COMPILE_OPTIMIZE);
+    printf("status %d\n", vm->status);
+    tehssl_run_string(vm, "Def F { Do If True { Print + 1 2; Noop } { 0 } }; F", COMPILE_LAZY | COMPILE_OPTIMIZE);
+    printf("status %d, F is now ", vm->status);
+    tehssl_print(tehssl_lookup(vm->global_scope, (char*)"F", FUN)->value);
+    putchar('\n');
+    // Words bound around a lazy block, or in one, are left alone when it is optimized
+    for (uint8_t options = 0; options <= (COMPILE_LAZY | COMPILE_OPTIMIZE); options++) {
+        tehssl_vm_t lvm = tehssl_new_vm();
+        tehssl_init_builtins(lvm);
+        tehssl_run_string(lvm, "Def F { Def + { 99 }; Print Do { + 1 2 } }; F; "
+            "Def G { Do { Print \"G\"; 5; Let * }; Print * 2 3 }; G", options);
+        printf("%s%s => status %d\n", options & COMPILE_LAZY ? "Lazy" : "Eager", options & COMPILE_OPTIMIZE ? ", optimized" : "", lvm->status);
+        tehssl_destroy(lvm);
+    }
+
+    printf("\n\n-----test 13: heap accounting and quotas----\n\n");
+    tehssl_gc(vm);
+    size_t counted = vm->num_pages * sizeof(struct tehssl_page);
+    tehssl_each_object(vm, o) counted += tehssl_payload_size(o);
+    printf("%zu objects, accounting matches: %s\n", vm->num_objects, counted == vm->heap_bytes ? "yes" : "no");
+    tehssl_vm_t small = tehssl_new_vm();
+    tehssl_init_builtins(small);
+    small->heap_limit = small->heap_bytes + 16 * 1024;
+    tehssl_run_string(small, "Def Deep { + 1 Deep }; Deep");
+    printf("unbounded recursion => status %d, peak within quota: %s\n", small->status, small->heap_peak <= small->heap_limit ? "yes" : "no");
+    small->status = OK;
+    small->stack = NULL;
+    char big[32 * 1024];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    tehssl_object_t too_big = tehssl_make_string(small, big);
+    printf("32K string => %s, status %d\n", too_big == NULL ? "NULL" : "allocated", small->status);
+    small->status = OK;
+    tehssl_run_string(small, "Def Fact { Let N; Let Acc; Do If < 1 N { Acc } { Fact - 1 N * N Acc } }; Print Fact 10 1");
+    printf("recovered => status %d\n", small->status);
+    tehssl_destroy(small);
+    size_t counts[2];
+    for (int paced = 0; paced <= 1; paced++) {
+        tehssl_vm_t pvm = tehssl_new_vm();
+        tehssl_init_builtins(pvm);
+        if (paced) pvm->gc_target = 1024 * 1024;
+        else pvm->gc_growth = 1.2;
+        tehssl_run_string(pvm, "Def Fib { Let N; Do If < 2 N { N } { + Fib - 1 N Fib - 2 N } }; Drop Fib 16");
+        counts[paced] = pvm->gc_count;
+        tehssl_destroy(pvm);
+    }
+    printf("1MB target heap collects less often than growth 1.2: %s\n", counts[1] < counts[0] ? "yes" : "no");
+
+    printf("\n\n-----test 14: parallel collection----\n\n");
+    size_t results[2][4];
+    for (int parallel = 0; parallel <= 1; parallel++) {
+        tehssl_vm_t pvm = tehssl_new_vm();
+        tehssl_init_builtins(pvm);
+        pvm->gc_threads = parallel ? 4 : 1;
+        pvm->enable_gc = false;
+        tehssl_push(pvm, pvm->stack, NULL);
+        pvm->stack->value = mytree(pvm, 13);
+        for (int i = 0; i < 20000; i++) tehssl_alloc(pvm, CONS);
+        pvm->enable_gc = true;
+        results[parallel][0] = tehssl_gc(pvm);
+        #ifdef TEHSSL_THREADS
+        if (parallel && pvm->gc_helpers != NULL) {
+            // How the marking was spread out depends on how the threads got scheduled
+            struct tehssl_marking* marking = &pvm->gc_helpers->marking;
+            size_t scanned = 0;
+            printf("objects scanned per marker:");
+            for (size_t i = 0; i < marking->count; i++) {
+                printf(" %zu", marking->markers[i].scanned);
+                scanned += marking->markers[i].scanned;
+            }
+            printf("\nbatches shared: %s, every live object scanned: %s\n", marking->shared > 0 ? "yes" : "no", scanned >= pvm->num_objects ? "yes" : "no");
+        }
+        #endif
+        pvm->stack->value->cdr = NULL;
+        results[parallel][1] = tehssl_gc(pvm);
+        results[parallel][2] = pvm->num_pages;
+        size_t counted = pvm->num_pages * sizeof(struct tehssl_page);
+        tehssl_each_object(pvm, o) counted += tehssl_payload_size(o);
+        results[parallel][3] = counted == pvm->heap_bytes;
+        tehssl_run_string(pvm, "Def Fib { Let N; Do If < 2 N { N } { + Fib - 1 N Fib - 2 N } }; Print Fib 10");
+        #ifdef TEHSSL_THREADS
+        if (parallel) {
+            struct tehssl_gc_helpers* helpers = pvm->gc_helpers;
+            tehssl_gc(pvm);
+            printf("helpers kept between collections: %s", helpers != NULL && pvm->gc_helpers == helpers ? "yes" : "no");
+            pvm->gc_threads = 2;
+            tehssl_gc(pvm);
+            printf(", %zu after gc_threads = 2\n", pvm->gc_helpers == NULL ? 0 : pvm->gc_helpers->count);
+        }
+        #endif
+        printf("%s: freed %zu, then %zu after dropping half the tree, %zu pages left, accounting matches: %s, status %d\n",
+            parallel ? "4 threads" : "1 thread", results[parallel][0], results[parallel][1], results[parallel][2], results[parallel][3] ? "yes" : "no", pvm->status);
+        tehssl_destroy(pvm);
+    }
+    printf("same as serial: %s\n", memcmp(results[0], results[1], sizeof(results[0])) == 0 ? "yes" : "no");
 
     printf("\n\n-----tests complete----\n\n");
 